@@ -9,15 +9,33 @@
 #include <iostream>
 #include <string>
 #include <chrono> // Deals with time
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <utility>
+#include <new>
+#include <cassert>
+
+// SSE2 is always there on x64, and MSVC doesn't define __SSE2__
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
 
 
-// Color structure
+// Color structure, padded to 4 bytes so every pixel is aligned
 struct RGBColor
 {
-    uint8_t r = 0;	uint8_t g = 0;	uint8_t b = 0;
+    uint8_t r = 0;	uint8_t g = 0;	uint8_t b = 0;	uint8_t a = 0;
 };
 
 
@@ -28,11 +46,133 @@ struct RGBFloat
 };
 
 
+// How a texture is addressed outside of 0 to 1
+enum WrapMode
+{
+    WRAP_CLAMP, // Hold to the edge texels
+    WRAP_REPEAT, // Tile the texture
+    WRAP_MIRROR, // Tile the texture, flipping every other copy
+    WRAP_MODE_COUNT
+};
+
+
+struct TriangleSetup;
+struct Triangle;
+
+
+// One mip level of a texture
+struct TextureLevel
+{
+    int width = 0;
+    int height = 0;
+    vector<RGBColor> px; // Rows from the bottom up, so v goes up the image. In 4x4 blocks once the texture is loaded.
+    int blocksX = 0; // Blocks in each row of blocks
+    vector<uint64_t> compressed; // The same 4x4 blocks in BC1, 8 bytes each
+    mutable int lastSampled = -1; // Frame the samplers last wanted this level, written through the binding
+};
+
+
 // Texture
 struct Texture
 {
-    // 128 by 128 texture
-    RGBColor px[16384];
+    string path; // File it was loaded from
+    int width = 0;
+    int height = 0;
+    vector<TextureLevel> levels; // The full size image, then each mip level half the size of the one before
+    int wrapMode = WRAP_CLAMP; // How coordinates outside 0 to 1 are brought back onto the texture
+    bool atlas = false; // Packed from other textures, so it's always clamped to keep them apart
+    // One bit per texel of the full size image, set where the texture is solid
+    vector<uint64_t> coverage;
+    int coverageStride = 0; // Words per row of the coverage mask
+    float compressedQuality = 0; // Peak signal to noise ratio of the compressed full size image, in dB
+    float compressTime = 0; // Milliseconds spent encoding every level in BC1
+    bool streamed = false; // Decoded in the background, so its levels can be evicted and decoded again
+    bool placeholder = false; // Drawn as one grey texel until it's first decoded
+    bool loading = false; // Waiting on a streaming thread
+    int firstResident = 0; // Finest mip level in memory, the ones before it were evicted
+};
+
+
+// A mip level being sampled, with its sizes ready for the samplers
+struct LevelBinding
+{
+    const RGBColor* px = nullptr;
+    const uint64_t* compressed = nullptr;
+    int* lastSampled = nullptr;
+    int blocksX = 0;
+    int width = 0;
+    int height = 0;
+    float scaleU = 0; // Width and height in texels
+    float scaleV = 0;
+};
+
+
+const int maxMipLevels = 16; // Enough for textures up to 32768 texels across
+const int texelBlockShift = 2; // Texels are stored in 4x4 blocks, so each block fills one 64 byte cache line
+const int atlasMaxTextureSize = 256; // Textures this size or smaller can be packed into an atlas
+const int atlasMaxSize = 2048; // Largest width and height of an atlas
+const int atlasMipLevels = 4; // Mip levels an atlas keeps, the smallest still has a one texel gutter
+const int atlasGutter = 1 << (atlasMipLevels - 1); // Texels of edge color around each texture in an atlas
+
+
+// The palette of a compressed block, kept by the sampler in case its neighbouring texels are sampled next
+struct DecodedBlock
+{
+    const uint64_t* block = nullptr;
+    uint32_t indices = 0; // Two bits for each texel, picking its palette color
+    RGBColor palette[4];
+};
+
+
+const int blockCacheSize = 256; // Decoded blocks kept, 8 KB
+
+
+// The texture being sampled
+struct TextureBinding
+{
+    const Texture* texture = nullptr;
+    const uint64_t* coverage = nullptr;
+    int coverageStride = 0;
+    int wrapMode = 0;
+    int levelCount = 0;
+    int firstLevel = 0; // Finest level in memory, finer ones are sampled from it
+    LevelBinding levels[maxMipLevels];
+};
+
+
+// A streamed texture to decode, and the texture it decodes into
+struct TextureRequest
+{
+    int texture = 0;
+    string path;
+    int levelCount = maxMipLevels; // Finest levels to decode, the ones that were evicted
+    Texture decoded; // Left without levels if the file can't be read. Starts with the BC1 blocks kept from evicted levels.
+};
+
+
+// Work passed between the main thread and the threads decoding streamed textures
+struct TextureStreamer
+{
+    vector<thread> threads;
+    mutex lock;
+    condition_variable wake;
+    deque<TextureRequest> waiting;
+    vector<TextureRequest> finished;
+    bool stopping = false;
+};
+
+
+// Screen-space gradients of a triangle's texture coordinates over z and of 1/z, used to find how many texels a pixel spans
+struct TextureGradients
+{
+    float uX = 0, uY = 0; // In texels of the full size image
+    float vX = 0, vY = 0;
+    float zX = 0, zY = 0;
+
+    // Find the gradients from the corners of the setup, with the points of tri in the same order
+    void Setup(const Triangle& tri, const TriangleSetup& setup);
+    // Mip level at a pixel, from its texture coordinates and 1/z
+    float Lod(float u, float v, float depth) const;
 };
 
 
@@ -78,10 +218,44 @@ struct Triangle
 };
 
 
+// A group of neighbouring triangles in a mesh, sorted as one when drawing
+struct MeshCluster
+{
+    int firstTri = 0;
+    int triCount = 0;
+    Vector3 center; // Center of the cluster's bounding box in model space
+};
+
+
+// An edge shared by up to two triangles of a mesh, drawn once by the wireframe
+struct MeshEdge
+{
+    int tri = 0; // Triangle the edge comes from, and its two corners in that triangle
+    int a = 0;
+    int b = 1;
+    int otherTri = -1; // The triangle on the other side, -1 if there is none
+};
+
+
 // A 3d object structure
 struct Mesh
 {
 	vector<Triangle> tris; // List of triangles that make up the mesh. A vector is a resizable array.
+    int texture = 0; // Which of the loaded textures it is drawn with
+    vector<MeshCluster> clusters;
+    vector<MeshEdge> edges;
+};
+
+
+// Materials that can be given to a mesh instance. Each has its own shader.
+enum Material
+{
+    MATERIAL_LIT, // Texture, vertex colors, lighting and fog as set by the number keys
+    MATERIAL_UNLIT, // Texture only
+    MATERIAL_VERTEX_COLOR, // Vertex colors only
+    MATERIAL_DEBUG_DEPTH, // Distance from the camera
+    MATERIAL_DEBUG_UV, // Texture coordinates
+    MATERIAL_COUNT
 };
 
 
@@ -91,9 +265,112 @@ struct MeshInstance
     Mesh instanceMesh;
     Vector3 position;
     Vector3 rotation;
+    int material = MATERIAL_LIT;
+    vector<uint8_t> frontFacing; // Which triangles faced the camera when last drawn
+};
+
+
+// A triangle snapped to the sub-pixel grid, ready to be rasterized with edge functions
+struct TriangleSetup
+{
+    int64_t x[3]; // Fixed-point screen coordinates
+    int64_t y[3];
+    float invZ[3];
+    int vertex[3]; // Which point of the source triangle each corner came from
+    float invArea;
+    int minX, maxX, minY, maxY; // Pixel bounds
+    int64_t edgeStart[3]; // Edge values at the center of pixel (minX, minY)
+    int64_t edgeStepX[3]; // Change in edge value per sub-pixel step
+    int64_t edgeStepY[3];
+    float maxDepth; // Depth of the nearest corner
+};
+
+
+// A cluster of an instance waiting to be drawn
+struct DrawItem
+{
+    int instance;
+    int cluster;
+    uint16_t key; // Quantized distance from the camera
+};
+
+
+// A projected triangle recorded for the visibility buffer
+struct VisibleTriangle
+{
+    Triangle tri; // Points in the winding order of the setup
+    TriangleSetup setup;
+    int material;
+    const Texture* texture;
+    TextureGradients gradients; // Found once when it's stored, so shading doesn't redo them for every run of pixels
+};
+
+
+typedef void (*DrawTriangleFunc)(const Triangle& tri);
+typedef void (*ShadeSpanFunc)(int i, int start, int end);
+
+
+// The compiled kernels of a material
+struct MaterialPipeline
+{
+    DrawTriangleFunc draw;
+    DrawTriangleFunc drawDepth; // Depth pre-pass
+    DrawTriangleFunc drawVisibility; // Visibility buffer
+    DrawTriangleFunc drawMultisample; // 4x MSAA
+    ShadeSpanFunc shadeVisibleSpan; // Shading of the visibility buffer
+};
+
+
+// Draw passes
+enum DrawPass
+{
+    PASS_FULL, // Depth test and shade in one go
+    PASS_DEPTH, // Depth pre-pass, writes only the depth buffer
+    PASS_COLOR // Shades pixels whose depth matches the pre-pass
+};
+
+
+// Pixel pipeline features. Each combination is compiled into its own variant of the pipeline.
+enum PipelineFeature
+{
+    PIPE_FILL = 1,
+    PIPE_FLAT = 2,
+    PIPE_FILTER = 4,
+    PIPE_VERTEX_COLOR = 8,
+    PIPE_LIGHTING = 16,
+    PIPE_FOG = 32,
+    PIPE_DEPTH_EQUAL = 64, // Color pass of a depth pre-pass
+    PIPE_VARIANTS = 128
+};
+
+
+// How mip levels are picked when a texture is made smaller on screen
+enum MipMode
+{
+    MIP_NONE, // Always sample the full size image
+    MIP_NEAREST, // Sample the nearest level to each pixel's size
+    MIP_LINEAR, // Blend the two nearest levels (trilinear with the texture filter)
+    MIP_MODE_COUNT
+};
+
+
+// Ways of storing the depth buffer
+enum DepthFormat
+{
+    DEPTH_FLOAT, // 1/z as a float
+    DEPTH_UNORM24, // 1/z scaled to 24 bits, kept in 32 bits
+    DEPTH_UNORM16, // 1/z scaled to 16 bits, half the memory of float
+    DEPTH_FORMAT_COUNT
 };
 
 
+// Number of floats to set aside for a shader's varyings
+constexpr int VaryingSlots(int count)
+{
+    return count > 0 ? count : 1;
+}
+
+
 // flags
 bool fillTris = true;
 bool vertexColorEnabled = false;
@@ -103,22 +380,99 @@ bool faceLighting = true;
 bool globalLightingFacingCamera = false;
 bool fog = false;
 bool applyTextureFilter = true;
+int mipMode = MIP_NEAREST;
+int wrapOverride = WRAP_MODE_COUNT; // Wrap mode every texture but an atlas is drawn with, WRAP_MODE_COUNT keeps each texture's own
 bool wireframe = false;
 bool bloom = false;
 bool dofBlur = false;
+bool visibilityBufferMode = false;
+bool depthPrePass = false;
+bool sortFrontToBack = true;
+bool hierarchicalZ = true;
+bool depthPrecisionView = false;
+bool msaa = false;
+bool dynamicResolution = false;
+bool checkerboard = false;
+bool frameCap = false;
+bool tiledFramebuffer = false;
+bool fastClear = true;
+bool compressedTextures = false;
 
 // Important variables
 RGBColor* screenColorData; // Screen data for player camera
+RGBColor* linearColorData; // Screen data in rows, for the screen texture when the screen data is tiled
 float* depthBuffer;
+uint32_t* depthBuffer24; // Depth buffers for the unorm depth formats
+uint16_t* depthBuffer16;
+int depthFormat = DEPTH_FLOAT;
+const double blurStartDepth = 0.037; // Pixels further than this are blurred
+RGBColor* precisionReference; // Frame drawn with float depth, for the precision view
+float* tileMinDepth; // Furthest depth stored in each tile in the units of the depth format, never nearer than the real value
+uint32_t* tileClearEpoch; // The last drawing of the scene each tile was cleared for
+uint32_t clearEpoch = 0; // Counts the drawings of the scene
+int tilesX = 0;
+int tilesY = 0;
+uint32_t* visibilityBuffer; // Visible triangle + 1 for each pixel, 0 if empty
+const int sampleCount = 4; // Samples per pixel with MSAA
+const int allSamples = (1 << sampleCount) - 1;
+const int sampleOffsetX[sampleCount] = { -2, 6, -6, 2 }; // Rotated grid sample positions in sub-pixels from the pixel center
+const int sampleOffsetY[sampleCount] = { -6, -2, 2, 6 };
+float* sampleDepthBuffer; // Depth of each sample with MSAA
+RGBColor* sampleColorBuffer; // Color of each sample with MSAA
+uint8_t* pixelCompressed; // Pixels whose samples all share the color of their first sample
+bool checkerboardActive = false; // Only half of the pixels are shaded this frame
+int checkerboardParity = 0; // Pixels with (x + y) % 2 equal to this are shaded this frame
+RGBColor* previousColor; // Last frame, reprojected to fill the pixels that weren't shaded
+float* previousDepth;
+RGBColor* savedColor; // This frame, kept for the next one
+float* savedDepth;
+bool historyValid = false;
+int historyWidth = 0;
+int historyHeight = 0;
+Vector3 previousCameraPosition;
+Vector3 previousCameraRotation;
+float previousCamRotX = 0;
+vector<VisibleTriangle> visibleTriangles; // Triangles drawn into the visibility buffer this frame
+int currentInstance = 0; // The instance being drawn
+vector<DrawItem> drawOrder; // Clusters sorted by depth this frame
+vector<DrawItem> drawOrderScratch;
+vector<float> drawOrderDepths; // View depth of each cluster in drawOrder, before it's sorted
+int clusterSize = 64; // Triangles per mesh cluster
+const float lineDepthTolerance = 0.98f; // How far behind the stored depth a wireframe line can be and still show
+MaterialPipeline materialPipelines[MATERIAL_COUNT]; // Pipeline variants picked for the current settings
+int drawPass = 0; // PASS_FULL, or which half of a depth pre-pass is being drawn
 float deltaT;// Multiply to get frame-independent speed.
 float fov = 1;
 float cameraNear = 1;
-int screenResolution = 512;
-Texture loadedTexture;
+int screenWidth = 512; // Size of the image the scene is drawn at
+int screenHeight = 512;
+int screenPitch = 512; // Pixels from the start of one row of the screen buffers to the next
+int screenPixels = 512 * 512; // Pixels in use in each screen buffer, padding included
+float aspectRatio = 1; // Width of the image over its height
+int maxWidth = 1024; // Size the screen data is allocated for, and the upper bound of dynamic resolution
+int maxHeight = 1024;
+int minHeight = 256;
+const int rowAlignment = 64; // Rows are padded to a multiple of this many pixels, so the rows of every screen buffer start on a cache line
+float targetFrameTime = 16.6f; // Milliseconds dynamic resolution tries to keep drawing under
+float averageRenderTime = 0;
+int resolutionCooldown = 0; // Frames left before dynamic resolution can change again
+int framesToDraw = 1; // Frames left to draw before the screen data stops changing
+float frameCapTime = 1000.0f / 60; // Shortest time in milliseconds a frame takes with the frame cap
+vector<Texture> loadedTextures; // Every texture loaded, the first is used by meshes whose material has none
+TextureBinding boundTexture; // Texture of the mesh being drawn
+DecodedBlock blockCache[blockCacheSize]; // Direct mapped by the address of the compressed block
+TextureStreamer textureStreamer;
+const int textureStreamingThreads = 2;
+size_t streamingBudget = size_t(64) << 20; // Bytes the levels of streamed textures can use before the least recently sampled are evicted
+int frameNumber = 0; // Frames drawn so far, to tell which levels were sampled lately
 BloomTexture bloomTexture;
 Vector3 globalLightPosition = { 4000, -1000, 1000 };
 int fogDepth = 20;
 int blurSize = 3;
+const int subPixelBits = 4; // Screen coordinates are snapped to 1/16th of a pixel
+const int subPixelScale = 1 << subPixelBits;
+const int tileShift = 3; // The screen is split into 8x8 pixel tiles
+const int tileSize = 1 << tileShift;
 
 // Resources
 vector<Mesh> loadedMeshes;
@@ -140,20 +494,186 @@ void processInput(GLFWwindow* window);
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
 // Loads objects and textures
 void  LoadAssets();
+// Pack the meshes of a model into an atlas where they can share one, then load every mesh left and give it an instance
+void AddModel(vector<Mesh>& meshes);
+// Add a model with packed and unpacked materials and check every material is on a drawn mesh
+bool CheckModelMeshes();
+// Allocates the screen data for the largest resolution
+void CreateScreenBuffers();
+// Allocate a screen buffer that starts on a cache line
+template <class T>
+T* NewScreenBuffer(int count);
+// Changes the resolution the scene is drawn at
+void SetScreenResolution(int width, int height);
+// Picks the resolution for the next frame from how long the last frames took to draw
+void UpdateDynamicResolution(float renderTime);
+// Asks for the scene to be drawn again because something on screen changed
+void InvalidateFrame();
+// Draws the scene and applies post-processing to the screen data
+void RenderFrame();
+// Clears the screen data and draws every mesh into it. Only a scene that's shown reads and saves the checkerboard history.
+void RenderScene(bool useHistory = true);
+// Clear the pixels of a tile in every buffer drawn to this frame
+void ClearTile(int tileX, int tileY);
+// Clear the tiles no triangle reached, so they show the background
+void ClearUntouchedTiles();
+// Tints the pixels shaded this frame that differ from the frame drawn with float depth
+void MarkDepthPrecisionErrors();
+// Fills the pixels that weren't shaded this frame from their neighbours, and from the last frame when the history is used
+void ReconstructCheckerboard(bool useHistory);
+// Move a point from this frame's camera space into last frame's
+Vector3 CameraToPreviousCamera(Vector3 vect);
+// Check if the scene is drawn with MSAA in the current mode
+bool Multisampling();
+// Draw each edge of the meshes once with a depth-tested line
+void DrawWireframe();
+// Limit the part of a line drawn to one side of a clipping edge
+bool ClipLine(float p, float q, float& t0, float& t1);
+// Draw a line between two points in camera space
+void DrawLine(Vector3 a, Vector3 b, RGBColor color);
+// Transforms and draws every mesh instance
+void DrawScene();
+// Transforms and draws one triangle of a mesh instance
+void DrawMeshTriangle(int i, int j);
+// Move a point from an instance's model space into camera space
+Vector3 InstanceToCamera(Vector3 vect, const MeshInstance& instance);
+// Sort the clusters of every instance from nearest to furthest
+void SortDrawOrder();
+// Split a mesh into clusters of neighbouring triangles
+void BuildClusters(Mesh& mesh);
+// Find the unique edges of a mesh
+void BuildEdges(Mesh& mesh);
 // Updates physics, called every frame
 void UpdatePhysics(float delta);
 // Move a point
 Vector3 Translate(Vector3 vect, Vector3 vect2);
 // Clip a triangle
 void ClipAndDraw(Triangle tri);
-// Draw a triangle
+// Draw a triangle with the selected pipeline
 void DrawTriangle(Triangle tri);
+// Snap a projected triangle to the sub-pixel grid and find its edge functions
+bool SetupTriangle(const Triangle& tri, TriangleSetup& setup);
+// Rasterize meshes of triangles sharing edges and check every pixel is covered at most once, and the inside exactly once
+bool CheckFillRule();
+// Find the depth of a pixel from its screen-space barycentric weights
+float InterpolateDepth(const TriangleSetup& setup, float b0, float b1);
+// Find the furthest depth in a tile after a triangle covered it
+void UpdateTileDepth(int tileX, int tileY, bool multisample);
+// Find the edge values of each MSAA sample relative to the pixel center
+void SampleEdgeOffsets(const TriangleSetup& setup, int64_t offsets[3][sampleCount]);
+// Store a color and depths into the samples of a pixel a triangle won
+void WriteSamples(int pixel, int samples, RGBColor color, const float* depths);
+// Average the samples of each pixel into the screen data
+void ResolveSamples();
+// Find where a pixel is stored in the screen buffers
+int PixelIndex(int i, int j);
+// Copy the screen data into rows for the screen texture
+const RGBColor* LinearScreenData();
+// Store depth in the current depth format
+void WriteDepth(int index, float depth);
+// Check if a pixel is left for checkerboard reconstruction this frame
+bool SkipShading(int i, int j);
+// Read a pixel's stored depth as 1/z, whatever the depth format
+float StoredDepth(int index);
+// Check if a pixel's stored depth is far enough away to be blurred
+bool IsFarPixel(int index);
+// Find the feature mask of the pipeline for the current settings
+int PipelineFeatures();
+// Pick the compiled pipeline variants for the current settings
+void SelectPipeline();
+// Shade each pixel of the visibility buffer
+void ShadeVisibilityBuffer();
+// Draw a triangle with a shader and a pipeline compiled for one set of features
+template <class Shader, int features>
+void DrawTrianglePipeline(const Triangle& tri);
+// Write only the depth of a triangle
+template <class Shader, int features>
+void DrawTriangleDepthPipeline(const Triangle& tri);
+// Write the depth and triangle ID of a triangle into the visibility buffer
+template <class Shader, int features>
+void DrawTriangleVisibilityPipeline(const Triangle& tri);
+// Draw a triangle with depth tested at every sample and shading once per pixel
+template <class Shader, int features>
+void DrawTriangleMultisamplePipeline(const Triangle& tri);
+// Shade a run of pixels in a row of the visibility buffer
+template <class Shader, int features>
+void ShadeVisibleSpan(int i, int start, int end);
+// Load a texture, or find it if it was loaded before. Returns its index, or -1 if the file can't be read.
+// Textures too big for an atlas are streamed, and drawn with a placeholder until they're decoded.
+int LoadTexture(const string& path);
+// Read an image file into a texture with its coverage mask, mip levels and compressed blocks. Returns false if it can't be read.
+bool DecodeTexture(const string& path, Texture& texture, int levelCount = maxMipLevels);
+// Make a texture of one texel
+void SingleTexelTexture(Texture& texture, RGBColor color);
+// Start and finish the threads that decode streamed textures
+void StartTextureStreaming();
+void StopTextureStreaming();
+// Decode requested textures until streaming stops, run by each streaming thread
+void StreamTextures();
+// Ask a streaming thread to decode a texture
+void RequestTexture(int t);
+// Put decoded textures in place, evict the least recently sampled levels over the budget, and ask for evicted levels that are wanted again
+void UpdateTextureStreaming();
+// Bytes of a mip level the samplers read in the current texture format
+size_t LevelMemory(const TextureLevel& level);
+// Print the size, compression quality and encoding time of each texture, and how long frames take to draw
+void PrintTextureStats();
+// Make a texture the one sampled by the shaders
+void BindTexture(const Texture* texture);
+// Turn the magenta color key into the coverage mask, and give see-through texels the colors of their solid neighbours
+void BuildCoverageMask(Texture& texture);
+// Shrink the full size image into each smaller mip level
+void BuildMipLevels(Texture& texture, int levelCount = maxMipLevels);
+// Pack the small textures of a model's meshes into one atlas, and merge the meshes using it into the first mesh
+void BuildAtlas(vector<Mesh>& meshes);
+// Reorder the texels of a level from rows into 4x4 blocks
+void StoreInBlocks(TextureLevel& level);
+// Encode the levels of a texture without BC1 blocks yet, once their texels are in blocks, and measure the quality lost
+void CompressTexture(Texture& texture);
+// Encode 16 texels as a BC1 block, only fitting the colors of the texels set in valid
+uint64_t EncodeBlock(const RGBColor* texels, int valid);
+// Expand a BC1 block into its 16 texels
+void DecodeBlock(uint64_t block, RGBColor* texels);
+// Find the four colors a BC1 block can pick from, given its two end colors
+void BlockPalette(uint16_t color0, uint16_t color1, RGBColor* palette);
+// Pick the palette color nearest each texel, and return the block with its squared error
+uint64_t FitBlockIndices(const RGBColor* texels, int valid, uint16_t color0, uint16_t color1, int& error);
+// Convert between 8 bits a channel and 5:6:5
+uint16_t To565(float r, float g, float b);
+RGBColor From565(uint16_t color);
+// Find where a texel of a bound mip level is stored
+int TexelAddress(const LevelBinding& level, int x, int y);
+// Read a texel of a bound mip level, from the decoded block cache if it's compressed
+template <bool compressed>
+RGBColor FetchTexel(const LevelBinding& level, int x, int y);
+// Round down to a whole number
+int FloorToInt(float x);
+// Bring a texel coordinate onto a texture side of size texels
+template <int wrapMode>
+int WrapTexel(int x, int size);
+// Check if the texture is solid at u and v, which are 0 to 1 across the texture
+bool TexelCovered(float u, float v);
+// Sample one mip level of the texture at u and v
+template <int wrapMode, bool compressed>
+RGBColor SampleNearest(float u, float v, int level);
+template <int wrapMode, bool compressed>
+RGBColor SampleFiltered(float u, float v, int level);
+// Sample the texture with the mip levels picked for lod by the mip mode
+template <int wrapMode, bool compressed>
+RGBColor SampleLevels(float u, float v, float lod, bool filtered);
+// Sample the texture with its wrap mode and format, which are picked once here so the samplers are compiled for each
+RGBColor SampleTexture(float u, float v, float lod, bool filtered);
 // Rotate a point
 Vector3 Rotate(Vector3 vect, Vector3 rot);
+// Undo a rotation
+Vector3 RotateInverse(Vector3 vect, Vector3 rot);
 // Find the normal of a triangle
 float CalculateNormal(Triangle tri);
-// Apply a bilinear filter
-RGBColor Filter(float x, float y);
+// Put the channels of a color into one number, red in the lowest byte
+uint32_t PackColor(RGBColor color);
+// Apply a bilinear filter to a mip level at a position in its texels, in fixed point
+template <int wrapMode, bool compressed>
+RGBColor Filter(float x, float y, int level);
 // Apply filter to bloom texture
 RGBColor FilterBloom(float x, float y);
 // Blur
@@ -164,7 +684,9 @@ void Blur(int x, int y);
 // The actions performed when starting and running the engine
 void RunEngine()
 {
-    
+    // Debug builds check a model whose materials don't all fit in the atlas still has every one of them drawn
+    assert(CheckModelMeshes());
+
     // Load the meshes
     LoadAssets();
 
@@ -175,21 +697,29 @@ void RunEngine()
     // Initialize the library
     glfwInit();
 
+    // The streaming threads wake the window when they finish, so they start once it can be woken
+    StartTextureStreaming();
+
     // Create a windowed mode window and its OpenGL context
     float width = glfwGetVideoMode(glfwGetPrimaryMonitor())->width;
     float height = glfwGetVideoMode(glfwGetPrimaryMonitor())->height;
 
     // Sets to perfect screen resolution, (probably not the best performance)
-    //screenResolution = height;
-    screenResolution = 1024;
-    //screenResolution = 256;
+    //maxHeight = height;
+    maxHeight = 1024;
+    //maxHeight = 256;
+
+    // The width follows the shape of the monitor, so every pixel drawn is square on screen
+    maxWidth = (int(maxHeight * width / height) >> tileShift) << tileShift;
+    screenWidth = maxWidth;
+    screenHeight = maxHeight;
     
     // Update the screen data to the screen size
-    screenColorData = new RGBColor[screenResolution * screenResolution];
-    depthBuffer = new float[screenResolution * screenResolution];
+    CreateScreenBuffers();
 
+    // Debug builds check the rasterizer leaves no cracks or overlaps along shared edges
+    assert(CheckFillRule());
 
-    float windowRatio = height / width;
 
     GLFWwindow* window = glfwCreateWindow(width, height, "", glfwGetPrimaryMonitor(), nullptr);
 
@@ -210,162 +740,62 @@ void RunEngine()
     // Loop until the user closes the window
     while (!glfwWindowShouldClose(window))
     {
+        // Nothing on screen changes until there is input, so sleep until there is some
+        if (framesToDraw == 0)
+            glfwWaitEvents();
+
         // Start the delta timer
         std::chrono::high_resolution_clock time;
         auto start = time.now();
 
-        for (int y = 0; y < (screenResolution * screenResolution); y++)
-        {
-            screenColorData[y] = { 0, 0, 0 };
-            depthBuffer[y] = 0;
-        }
-        
+        UpdateTextureStreaming();
+
         // Update game physics
         UpdatePhysics(deltaT);
 
         /////////////////////////////////////////////////////////////////////////// Drawing
 
+        // The last frame's screen data is reused while nothing has changed
+        bool drawFrame = framesToDraw > 0;
+        int renderedWidth = screenWidth;
+        int renderedHeight = screenHeight;
+        int renderedPitch = screenPitch;
+        const RGBColor* uploadData = screenColorData;
 
-        // Draw the triangles for each loaded mesh
-        for (int i = 0; i < loadedMeshInstances.size(); i++)
-        {
-            for (int j = 0; j < loadedMeshInstances.at(i).instanceMesh.tris.size(); j++)
-            {
-                Triangle worldPoint = loadedMeshes.at(i).tris[j];
-
-                
-
-                worldPoint.p[0].coord = Rotate(worldPoint.p[0].coord, loadedMeshInstances.at(i).rotation);
-                worldPoint.p[1].coord = Rotate(worldPoint.p[1].coord, loadedMeshInstances.at(i).rotation);
-                worldPoint.p[2].coord = Rotate(worldPoint.p[2].coord, loadedMeshInstances.at(i).rotation);
-
-
-                // Apply object transformations and rotations
-                worldPoint.p[0].coord = Translate(worldPoint.p[0].coord, loadedMeshInstances.at(i).position);
-                worldPoint.p[1].coord = Translate(worldPoint.p[1].coord, loadedMeshInstances.at(i).position);
-                worldPoint.p[2].coord = Translate(worldPoint.p[2].coord, loadedMeshInstances.at(i).position);
-
-                ////////////////////////////////////////////////////////////////////////////////////////////////////////
-                worldPoint.p[0].coord = Translate(worldPoint.p[0].coord, globalLightPosition);
-                worldPoint.p[1].coord = Translate(worldPoint.p[1].coord, globalLightPosition);
-                worldPoint.p[2].coord = Translate(worldPoint.p[2].coord, globalLightPosition);
-
-                if (!globalLightingFacingCamera)
-                {
-                    float lightingNormal = CalculateNormal(worldPoint);
-
-                    worldPoint.lighting = (lightingNormal + 1) * 100;
-                }
-
-                worldPoint.p[0].coord = Translate(worldPoint.p[0].coord, { -globalLightPosition.x, -globalLightPosition.y, -globalLightPosition.z });
-                worldPoint.p[1].coord = Translate(worldPoint.p[1].coord, { -globalLightPosition.x, -globalLightPosition.y, -globalLightPosition.z });
-                worldPoint.p[2].coord = Translate(worldPoint.p[2].coord, { -globalLightPosition.x, -globalLightPosition.y, -globalLightPosition.z });
-                /////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-                
-
-                worldPoint.p[0].coord = Translate(worldPoint.p[0].coord, cameraPosition);
-                worldPoint.p[1].coord = Translate(worldPoint.p[1].coord, cameraPosition);
-                worldPoint.p[2].coord = Translate(worldPoint.p[2].coord, cameraPosition);
-
-                
-
-                float dotProduct = CalculateNormal(worldPoint);
-
-
-                // Draw the projected triangle.
-                if (dotProduct < 0)
-                {     
-                    // Rotate each triangle to match camera space, and then project it.
-
-                    Vector3 rot = Rotate(cameraRotation, { 0, 0, camRotX });
-
-                    worldPoint.p[0].coord = Rotate(worldPoint.p[0].coord, cameraRotation);
-                    worldPoint.p[1].coord = Rotate(worldPoint.p[1].coord, cameraRotation);
-                    worldPoint.p[2].coord = Rotate(worldPoint.p[2].coord, cameraRotation);
-
-                    worldPoint.p[0].coord = Rotate(worldPoint.p[0].coord, { 0, 0, camRotX });
-                    worldPoint.p[1].coord = Rotate(worldPoint.p[1].coord, { 0, 0, camRotX });
-                    worldPoint.p[2].coord = Rotate(worldPoint.p[2].coord, { 0, 0, camRotX });
-                    
-
-                    if (faceLighting)
-                    {
-                        if (globalLightingFacingCamera)
-                        {
-                            worldPoint.lighting = (dotProduct + 1) * 100;
-                        }
-                    }
-
-                    ClipAndDraw(worldPoint);
-                }
-            }
-        }
-
-
-        if (bloom)
+        if (drawFrame)
         {
-            for (int i = 0; i < 1024; i++)
-            {
-                bloomTexture.px[i] = { 0, 0, 0 };
-            }
+            framesToDraw--;
 
-            for (int y = 0; y < screenResolution; y++)
-            {
-                for (int x = 0; x < screenResolution; x++)
-                {
-                    bloomTexture.px[(int(float(y) / screenResolution * 32) * 32) + int(float(x) / screenResolution * 32)].r += float(screenColorData[x + y * screenResolution].r) * 0.001;
-                    bloomTexture.px[(int(float(y) / screenResolution * 32) * 32) + int(float(x) / screenResolution * 32)].g += float(screenColorData[x + y * screenResolution].g) * 0.001;
-                    bloomTexture.px[(int(float(y) / screenResolution * 32) * 32) + int(float(x) / screenResolution * 32)].b += float(screenColorData[x + y * screenResolution].b) * 0.001;
-                }
-            }
+            auto renderStart = time.now();
+            RenderFrame();
+            uploadData = LinearScreenData();
+            renderedWidth = screenWidth;
+            renderedHeight = screenHeight;
+            renderedPitch = screenPitch;
 
-            for (int y = 0; y < screenResolution; y++)
-            {
-                for (int x = 0; x < screenResolution; x++)
-                {
-                    RGBColor blur = FilterBloom((float(x) / screenResolution) * 32, (float(y) / screenResolution) * 32);
-                    
-                    if (screenColorData[x + y * screenResolution].r + blur.r < 255)
-                        screenColorData[x + y * screenResolution].r += blur.r;
-                    else
-                        screenColorData[x + y * screenResolution].r = 255;
-                    if (screenColorData[x + y * screenResolution].g + blur.g < 255)
-                        screenColorData[x + y * screenResolution].g += blur.g;
-                    else
-                        screenColorData[x + y * screenResolution].g = 255;
-                    if (screenColorData[x + y * screenResolution].b + blur.b < 255)
-                        screenColorData[x + y * screenResolution].b += blur.b;
-                    else
-                        screenColorData[x + y * screenResolution].b = 255;
-                }
-            }
+            // Only drawing time counts, waiting for the screen to swap would hide how much time is left
+            UpdateDynamicResolution(std::chrono::duration<float, std::milli>(time.now() - renderStart).count());
         }
 
-        // Apply depth of field blur
-        if (dofBlur)
-        {
-            for (int y = 0; y < screenResolution; y++)
-            {
-                for (int x = 0; x < screenResolution; x++)
-                {
-                    Blur(x, y);
-                }
-            }
-        }
-        
-        
         ///////////////////////////////////////////////////////////////////////////
 
         // Create window quad
         glBegin(GL_QUADS);
-        glTexCoord2f(0.0, 1.0); glVertex3f(-windowRatio, -1.0f, 0.0f);
-        glTexCoord2f(0.0, 0.0); glVertex3f(-windowRatio, 1.0f, 0.0f);
-        glTexCoord2f(1.0, 0.0); glVertex3f(windowRatio, 1.0f, 0.0f);
-        glTexCoord2f(1.0, 1.0); glVertex3f(windowRatio, -1.0f, 0.0f);
+        glTexCoord2f(0.0, 1.0); glVertex3f(-1.0f, -1.0f, 0.0f);
+        glTexCoord2f(0.0, 0.0); glVertex3f(-1.0f, 1.0f, 0.0f);
+        glTexCoord2f(1.0, 0.0); glVertex3f(1.0f, 1.0f, 0.0f);
+        glTexCoord2f(1.0, 1.0); glVertex3f(1.0f, -1.0f, 0.0f);
         glEnd();
 
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, screenResolution, screenResolution, 0, GL_RGB, GL_UNSIGNED_BYTE, screenColorData);
+        // Lower resolutions are scaled up bilinearly when the texture is drawn
+        if (drawFrame)
+        {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, renderedHeight < maxHeight ? GL_LINEAR : GL_NEAREST);
+
+            // The padding at the end of each row is skipped
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, renderedPitch);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, renderedWidth, renderedHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, uploadData);
+        }
 
         // Swap front and back buffers
         glfwSwapBuffers(window);
@@ -377,7 +807,9 @@ void RunEngine()
         // Process player input
         processInput(window);
 
-        
+        // Wait out the rest of the frame with the frame cap instead of drawing frames nobody will see
+        if (frameCap)
+            std::this_thread::sleep_until(start + std::chrono::microseconds(int(frameCapTime * 1000)));
 
         // Find the frame time
         auto end = time.now();
@@ -385,887 +817,4014 @@ void RunEngine()
         deltaT = std::chrono::duration_cast<ms>(end - start).count();
     }
 
+    StopTextureStreaming();
     glfwTerminate();
 }
 
 
 
-void UpdatePhysics(float delta)
+void CreateScreenBuffers()
 {
-    Vector3 rotatedVelocity = cameraVelocity;
+    // Allocated once for the largest resolution. Smaller resolutions use the start of each buffer.
+    int maxPitch = (maxWidth + rowAlignment - 1) / rowAlignment * rowAlignment;
+    int pixels = maxPitch * (((maxHeight + tileSize - 1) >> tileShift) << tileShift);
+    int tiles = ((maxWidth + tileSize - 1) >> tileShift) * ((maxHeight + tileSize - 1) >> tileShift);
+
+    screenColorData = NewScreenBuffer<RGBColor>(pixels);
+    linearColorData = NewScreenBuffer<RGBColor>(pixels);
+    depthBuffer = NewScreenBuffer<float>(pixels);
+    depthBuffer24 = NewScreenBuffer<uint32_t>(pixels);
+    depthBuffer16 = NewScreenBuffer<uint16_t>(pixels);
+    precisionReference = NewScreenBuffer<RGBColor>(pixels);
+    sampleDepthBuffer = NewScreenBuffer<float>(pixels * sampleCount);
+    sampleColorBuffer = NewScreenBuffer<RGBColor>(pixels * sampleCount);
+    pixelCompressed = NewScreenBuffer<uint8_t>(pixels);
+    previousColor = NewScreenBuffer<RGBColor>(pixels);
+    previousDepth = NewScreenBuffer<float>(pixels);
+    savedColor = NewScreenBuffer<RGBColor>(pixels);
+    savedDepth = NewScreenBuffer<float>(pixels);
+    visibilityBuffer = NewScreenBuffer<uint32_t>(pixels);
+    tileMinDepth = new float[tiles];
+    tileClearEpoch = new uint32_t[tiles]();
+
+    SetScreenResolution(screenWidth, screenHeight);
+}
 
-    rotatedVelocity = Rotate(rotatedVelocity, { 0, -cameraRotation.y, 0 });
 
-    cameraPosition.x += rotatedVelocity.x * 0.03 * delta;
-    cameraPosition.y += rotatedVelocity.y * 0.03 * delta;
-    cameraPosition.z += rotatedVelocity.z * 0.03 * delta;
+template <class T>
+T* NewScreenBuffer(int count)
+{
+    // 64 bytes is a cache line
+    return new (align_val_t(64)) T[count];
+}
 
 
-    cameraRotation.y += cameraRotVelocity * 0.08 * delta;
-    camRotX += cameraRotXVelocity * 0.08 * delta;
-    
+void SetScreenResolution(int width, int height)
+{
+    if (width != screenWidth || height != screenHeight)
+        InvalidateFrame();
+
+    screenWidth = width;
+    screenHeight = height;
+    screenPitch = (screenWidth + rowAlignment - 1) / rowAlignment * rowAlignment;
+    aspectRatio = float(screenWidth) / screenHeight;
+    tilesX = (screenWidth + tileSize - 1) >> tileShift;
+    tilesY = (screenHeight + tileSize - 1) >> tileShift;
+
+    // Whole rows of tiles, so the tiled layout fits too
+    screenPixels = screenPitch * (tilesY << tileShift);
+}
 
-    // Set rotation to wrap
-    if (cameraRotation.x > 6.283185)
-        cameraRotation.x -= 6.283185;
-    if (cameraRotation.x < 0)
-        cameraRotation.x += 6.283185;
-    if (cameraRotation.y > 6.283185)
-        cameraRotation.y -= 6.283185;
-    if (cameraRotation.y < 0)
-        cameraRotation.y += 6.283185;
 
+void UpdateDynamicResolution(float renderTime)
+{
+    // Smooth out single slow frames
+    averageRenderTime = averageRenderTime > 0 ? averageRenderTime * 0.9f + renderTime * 0.1f : renderTime;
 
-    // Spin the model
-    if (spinModel)
+    if (!dynamicResolution)
+    {
+        if (screenWidth != maxWidth || screenHeight != maxHeight)
+            SetScreenResolution(maxWidth, maxHeight);
+        return;
+    }
+
+    if (resolutionCooldown > 0)
+    {
+        resolutionCooldown--;
+        return;
+    }
+
+    // Drawing time grows with the pixel count, so the sides scale with the square root of the time.
+    // The resolution only drops when over the target and only grows when well under it, so it doesn't bounce between two sizes.
+    float scale = 1;
+
+    if (averageRenderTime > targetFrameTime)
+        scale = sqrtf(targetFrameTime * 0.9f / averageRenderTime);
+    else if (averageRenderTime < targetFrameTime * 0.7f)
+        scale = min(sqrtf(targetFrameTime * 0.9f / averageRenderTime), 1.1f);
+
+    // Whole tiles keep the tile grid simple, and the width keeps the shape of the full size image
+    int height = (int(screenHeight * scale) >> tileShift) << tileShift;
+    height = max(minHeight, min(height, maxHeight));
+    int width = height == maxHeight ? maxWidth : ((height * maxWidth / maxHeight) >> tileShift) << tileShift;
+
+    if (height != screenHeight)
     {
-        loadedMeshInstances[0].rotation.y += 0.0005 * delta;
-        if (loadedMeshInstances[0].rotation.y > 6.283185)
-            loadedMeshInstances[0].rotation.y -= 6.283185;
+        SetScreenResolution(width, height);
+
+        // Give the average time to settle at the new resolution
+        resolutionCooldown = 30;
     }
 }
 
 
+void InvalidateFrame()
+{
+    // Checkerboard rendering needs a frame of each parity to fill in every pixel
+    framesToDraw = checkerboard ? 2 : 1;
+}
+
 
-void Blur(int x, int y)
+void RenderFrame()
 {
-    // Only blur far pixels
-    if (depthBuffer[x + y * screenResolution] < 0.037)
+    frameNumber++;
+
+    // The shaded half of the checkerboard alternates every frame
+    checkerboardParity ^= 1;
+
+    if (depthPrecisionView && depthFormat != DEPTH_FLOAT)
     {
-        // The number of pixels that will be blurred together
-        float blurredPixels = 0;
-        float combinedR = 0;
-        float combinedG = 0;
-        float combinedB = 0;
+        // Draw with float depth first so the pixels the compact format gets wrong can be found
+        int format = depthFormat;
+        // It's drawn in the same frame as the one shown, so it must not take that frame's history or replace it
+        depthFormat = DEPTH_FLOAT;
+        RenderScene(false);
+        copy(screenColorData, screenColorData + screenPixels, precisionReference);
+
+        depthFormat = format;
+        RenderScene();
+        MarkDepthPrecisionErrors();
+    }
+    else
+    {
+        RenderScene();
+    }
 
-        for (int i = -blurSize; i <= blurSize; i++)
-        {
-            for (int j = -blurSize; j <= blurSize; j++)
-            {
-                if ((i + y >= 0) && (i + y < screenResolution) && (j + x >= 0) && (j + x < screenResolution) && (depthBuffer[x + j + (y + i) * screenResolution] < 0.037))
-                {
 
-                    float blurAmount = (blurSize - abs(float(i) / blurSize)) * (blurSize - abs(float(j) / blurSize));
-                    combinedR += screenColorData[x + j + (y + i) * screenResolution].r * blurAmount;
-                    combinedG += screenColorData[x + j + (y + i) * screenResolution].g * blurAmount;
-                    combinedB += screenColorData[x + j + (y + i) * screenResolution].b * blurAmount;
+    if (bloom)
+    {
+        for (int i = 0; i < 1024; i++)
+        {
+            bloomTexture.px[i] = { 0, 0, 0 };
+        }
 
-                    blurredPixels += blurAmount;
-                }
+        for (int y = 0; y < screenHeight; y++)
+        {
+            for (int x = 0; x < screenWidth; x++)
+            {
+                int index = PixelIndex(y, x);
+                bloomTexture.px[(int(float(y) / screenHeight * 32) * 32) + int(float(x) / screenWidth * 32)].r += float(screenColorData[index].r) * 0.001;
+                bloomTexture.px[(int(float(y) / screenHeight * 32) * 32) + int(float(x) / screenWidth * 32)].g += float(screenColorData[index].g) * 0.001;
+                bloomTexture.px[(int(float(y) / screenHeight * 32) * 32) + int(float(x) / screenWidth * 32)].b += float(screenColorData[index].b) * 0.001;
             }
         }
 
-        float blurDiv = 1 / blurredPixels;
-
-        combinedR *= blurDiv;
-        combinedG *= blurDiv;
-        combinedB *= blurDiv;
-
-        // Add the colors together
-        screenColorData[x + y * screenResolution] = { uint8_t(combinedR), uint8_t(combinedG), uint8_t(combinedB) };
+        for (int y = 0; y < screenHeight; y++)
+        {
+            for (int x = 0; x < screenWidth; x++)
+            {
+                RGBColor blur = FilterBloom((float(x) / screenWidth) * 32, (float(y) / screenHeight) * 32);
+                int index = PixelIndex(y, x);
+                
+                if (screenColorData[index].r + blur.r < 255)
+                    screenColorData[index].r += blur.r;
+                else
+                    screenColorData[index].r = 255;
+                if (screenColorData[index].g + blur.g < 255)
+                    screenColorData[index].g += blur.g;
+                else
+                    screenColorData[index].g = 255;
+                if (screenColorData[index].b + blur.b < 255)
+                    screenColorData[index].b += blur.b;
+                else
+                    screenColorData[index].b = 255;
+            }
+        }
+    }
 
-        return;
+    // Apply depth of field blur
+    if (dofBlur)
+    {
+        for (int y = 0; y < screenHeight; y++)
+        {
+            for (int x = 0; x < screenWidth; x++)
+            {
+                Blur(x, y);
+            }
+        }
     }
-    else
-        return;
 }
 
 
-
-RGBColor Filter(float x, float y)
+void RenderScene(bool useHistory)
 {
-    // Wrap the coordinates on the texture for tiling
+    // With fast clear, each tile is only cleared when the first triangle reaches it, or after drawing if none did
+    clearEpoch++;
 
+    if (!fastClear)
+    {
+        // The padding is cleared too, so each buffer is cleared in one go
+        int pixels = screenPixels;
 
-    // find the distance the point is between pixels so add weight to each sample for filtering
-    // Use the wrapped coordinates to find the correct pixel on the texture
+        fill(screenColorData, screenColorData + pixels, RGBColor{ 0, 0, 0 });
 
-    RGBColor centerSample = loadedTexture.px[int(x) + (int(y) * 128)];
-    if (centerSample.r == 255 && centerSample.g == 0 && centerSample.b == 255)
-        return centerSample;
+        // Only the buffer of the depth format in use is cleared
+        if (depthFormat == DEPTH_UNORM16)
+            fill(depthBuffer16, depthBuffer16 + pixels, 0);
+        else if (depthFormat == DEPTH_UNORM24)
+            fill(depthBuffer24, depthBuffer24 + pixels, 0);
+        else
+            fill(depthBuffer, depthBuffer + pixels, 0.0f);
 
-    // Find the pixels around the sampled pixel
-    x -= 0.5;
-    y -= 0.5;
+        if (visibilityBufferMode)
+            fill(visibilityBuffer, visibilityBuffer + pixels, 0);
 
-    RGBColor sample1 = loadedTexture.px[int(x) + (int(y) * 128)];
-    RGBColor sample2 = loadedTexture.px[int(x+1) + (int(y) * 128)];
-    RGBColor sample3 = loadedTexture.px[int(x) + (int(y+1) * 128)];
-    RGBColor sample4 = loadedTexture.px[int(x+1) + (int(y+1) * 128)];
+        // Every pixel starts compressed, so only the first sample's color has to be cleared
+        if (Multisampling())
+        {
+            fill(sampleDepthBuffer, sampleDepthBuffer + (pixels * sampleCount), 0.0f);
+            fill(pixelCompressed, pixelCompressed + pixels, 1);
 
-    float offset_x = (x - int(x));
-    float offset_y = (y - int(y));
-    float totalOffset = offset_x * offset_y;
+            for (int p = 0; p < pixels; p++)
+                sampleColorBuffer[p * sampleCount] = { 0, 0, 0 };
+        }
 
-    if (sample1.r == 255 && sample1.g == 0 && sample1.b == 255)
-        sample1 = centerSample;
-    if (sample2.r == 255 && sample2.g == 0 && sample2.b == 255)
-        sample2 = centerSample;
-    if (sample3.r == 255 && sample3.g == 0 && sample3.b == 255)
-        sample3 = centerSample;
-    if (sample4.r == 255 && sample4.g == 0 && sample4.b == 255)
-        sample4 = centerSample;
+        fill(tileClearEpoch, tileClearEpoch + (tilesX * tilesY), clearEpoch);
+    }
+
+    fill(tileMinDepth, tileMinDepth + (tilesX * tilesY), 0.0f);
+
+    // Draw the triangles for each loaded mesh
+    if (visibilityBufferMode)
+        visibleTriangles.clear();
+
+    checkerboardActive = checkerboard && !Multisampling();
+
+    if (depthPrePass && !visibilityBufferMode)
+    {
+        // Find the nearest depth of every pixel first, so shading only runs once per visible pixel
+        drawPass = PASS_DEPTH;
+        SelectPipeline();
+        DrawScene();
+        drawPass = PASS_COLOR;
+        SelectPipeline();
+        DrawScene();
+        drawPass = PASS_FULL;
+    }
+    else
+    {
+        SelectPipeline();
+        DrawScene();
+    }
+
+    ClearUntouchedTiles();
+
+    // Shade every visible pixel once
+    if (visibilityBufferMode)
+        ShadeVisibilityBuffer();
+
+    if (Multisampling())
+        ResolveSamples();
+
+    if (checkerboardActive)
+        ReconstructCheckerboard(useHistory);
+    else
+        historyValid = false;
+
+    // The wireframe is drawn over the finished depth buffer
+    if (wireframe)
+        DrawWireframe();
+}
+
+
+void ClearTile(int tileX, int tileY)
+{
+    int x0 = tileX << tileShift;
+    int y0 = tileY << tileShift;
+    int count = min(tileSize, screenWidth - x0);
+    int y1 = min(y0 + tileSize, screenHeight);
+
+    // The pixels of a tile's row are next to each other in both screen layouts, so each row is cleared in one go
+    for (int i = y0; i < y1; i++)
+    {
+        int start = PixelIndex(i, x0);
+        int end = start + count;
+
+        fill(screenColorData + start, screenColorData + end, RGBColor{ 0, 0, 0 });
+
+        if (depthFormat == DEPTH_UNORM16)
+            fill(depthBuffer16 + start, depthBuffer16 + end, 0);
+        else if (depthFormat == DEPTH_UNORM24)
+            fill(depthBuffer24 + start, depthBuffer24 + end, 0);
+        else
+            fill(depthBuffer + start, depthBuffer + end, 0.0f);
+
+        if (visibilityBufferMode)
+            fill(visibilityBuffer + start, visibilityBuffer + end, 0);
+
+        if (Multisampling())
+        {
+            fill(sampleDepthBuffer + (start * sampleCount), sampleDepthBuffer + (end * sampleCount), 0.0f);
+            fill(pixelCompressed + start, pixelCompressed + end, 1);
+
+            for (int p = start; p < end; p++)
+                sampleColorBuffer[p * sampleCount] = { 0, 0, 0 };
+        }
+    }
+
+    tileClearEpoch[tileY * tilesX + tileX] = clearEpoch;
+}
+
+
+void ClearUntouchedTiles()
+{
+    for (int tileY = 0; tileY < tilesY; tileY++)
+        for (int tileX = 0; tileX < tilesX; tileX++)
+            if (tileClearEpoch[tileY * tilesX + tileX] != clearEpoch)
+                ClearTile(tileX, tileY);
+}
+
+
+bool Multisampling()
+{
+    // The visibility buffer and depth pre-pass only keep one depth per pixel
+    return msaa && !visibilityBufferMode && !depthPrePass;
+}
+
+
+void ResolveSamples()
+{
+    for (int i = 0; i < screenHeight; i++)
+    {
+        for (int j = 0; j < screenWidth; j++)
+        {
+            int p = PixelIndex(i, j);
+            const RGBColor* colors = sampleColorBuffer + (p * sampleCount);
+            const float* depths = sampleDepthBuffer + (p * sampleCount);
+
+            // Post-processing uses the nearest sample's depth
+            WriteDepth(p, max(max(depths[0], depths[1]), max(depths[2], depths[3])));
+
+            if (pixelCompressed[p])
+            {
+                screenColorData[p] = colors[0];
+                continue;
+            }
+
+            int r = 0;
+            int g = 0;
+            int b = 0;
+
+            for (int s = 0; s < sampleCount; s++)
+            {
+                r += colors[s].r;
+                g += colors[s].g;
+                b += colors[s].b;
+            }
+
+            screenColorData[p] = { uint8_t((r + 2) >> 2), uint8_t((g + 2) >> 2), uint8_t((b + 2) >> 2) };
+        }
+    }
+}
+
+
+void DrawWireframe()
+{
+    for (int i = 0; i < loadedMeshInstances.size(); i++)
+    {
+        const MeshInstance& instance = loadedMeshInstances[i];
+        const Mesh& mesh = loadedMeshes.at(i);
+
+        for (const MeshEdge& edge : mesh.edges)
+        {
+            // An edge can only be seen if one of its triangles faces the camera
+            if (!instance.frontFacing[edge.tri] && !(edge.otherTri >= 0 && instance.frontFacing[edge.otherTri]))
+                continue;
+
+            Vector3 a = InstanceToCamera(mesh.tris[edge.tri].p[edge.a].coord, instance);
+            Vector3 b = InstanceToCamera(mesh.tris[edge.tri].p[edge.b].coord, instance);
+
+            DrawLine(a, b, { 190, 190, 190 });
+        }
+    }
+}
+
+
+bool ClipLine(float p, float q, float& t0, float& t1)
+{
+    if (p == 0)
+        return q >= 0;
+
+    float t = q / p;
+
+    if (p < 0)
+    {
+        if (t > t1)
+            return false;
+        t0 = max(t0, t);
+    }
+    else
+    {
+        if (t < t0)
+            return false;
+        t1 = min(t1, t);
+    }
+
+    return true;
+}
+
+
+void DrawLine(Vector3 a, Vector3 b, RGBColor color)
+{
+    // Clip near
+    if (a.z < cameraNear && b.z < cameraNear)
+        return;
+
+    if (a.z < cameraNear || b.z < cameraNear)
+    {
+        float t = (cameraNear - a.z) / (b.z - a.z);
+        Vector3 nearPoint = { a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, cameraNear };
+
+        if (a.z < cameraNear)
+            a = nearPoint;
+        else
+            b = nearPoint;
+    }
+
+    // Project into pixels, the same way as the triangles
+    float x0 = (a.x / (a.z * fov * aspectRatio) + 0.5f) * screenWidth;
+    float y0 = (-a.y / (a.z * fov) + 0.5f) * screenHeight;
+    float x1 = (b.x / (b.z * fov * aspectRatio) + 0.5f) * screenWidth;
+    float y1 = (-b.y / (b.z * fov) + 0.5f) * screenHeight;
+    float depth0 = 1 / a.z;
+    float depth1 = 1 / b.z;
+
+    // Clip to the screen. 1/z is linear along the projected line, so it is clipped the same way.
+    float t0 = 0;
+    float t1 = 1;
+    float dx = x1 - x0;
+    float dy = y1 - y0;
+    float edgeX = float(screenWidth) - 0.01f;
+    float edgeY = float(screenHeight) - 0.01f;
+
+    if (!ClipLine(-dx, x0, t0, t1) || !ClipLine(dx, edgeX - x0, t0, t1) || !ClipLine(-dy, y0, t0, t1) || !ClipLine(dy, edgeY - y0, t0, t1))
+        return;
+
+    int startX = int(x0 + dx * t0);
+    int startY = int(y0 + dy * t0);
+    int endX = int(x0 + dx * t1);
+    int endY = int(y0 + dy * t1);
+    float startDepth = depth0 + (depth1 - depth0) * t0;
+    float endDepth = depth0 + (depth1 - depth0) * t1;
+
+    // Bresenham's line algorithm. Every step moves one pixel along the longer axis.
+    int stepsX = abs(endX - startX);
+    int stepsY = -abs(endY - startY);
+    int dirX = startX < endX ? 1 : -1;
+    int dirY = startY < endY ? 1 : -1;
+    int steps = max(stepsX, -stepsY);
+    int error = stepsX + stepsY;
+
+    int x = startX;
+    int y = startY;
+
+    for (int n = 0; n <= steps; n++)
+    {
+        float depth = steps > 0 ? startDepth + (endDepth - startDepth) * (float(n) / steps) : startDepth;
+        int index = PixelIndex(y, x);
+
+        // Lines lie on the surface they outline, so they pass if they are only slightly behind it
+        if (depth >= StoredDepth(index) * lineDepthTolerance)
+            screenColorData[index] = color;
+
+        int error2 = error * 2;
+
+        if (error2 >= stepsY)
+        {
+            error += stepsY;
+            x += dirX;
+        }
+        if (error2 <= stepsX)
+        {
+            error += stepsX;
+            y += dirY;
+        }
+    }
+}
+
+
+void ReconstructCheckerboard(bool useHistory)
+{
+    bool reproject = useHistory && historyValid && historyWidth == screenWidth && historyHeight == screenHeight;
+
+    // The transform from this frame's camera space to last frame's is the same for every pixel, so it is found once from the origin and the axes
+    Vector3 origin = CameraToPreviousCamera({ 0, 0, 0 });
+    Vector3 axisX = Translate(CameraToPreviousCamera({ 1, 0, 0 }), { -origin.x, -origin.y, -origin.z });
+    Vector3 axisY = Translate(CameraToPreviousCamera({ 0, 1, 0 }), { -origin.x, -origin.y, -origin.z });
+    Vector3 axisZ = Translate(CameraToPreviousCamera({ 0, 0, 1 }), { -origin.x, -origin.y, -origin.z });
+
+    // With the camera where it was, every pixel's history is at the same place on the screen
+    bool cameraStill = cameraPosition.x == previousCameraPosition.x && cameraPosition.y == previousCameraPosition.y && cameraPosition.z == previousCameraPosition.z
+        && cameraRotation.x == previousCameraRotation.x && cameraRotation.y == previousCameraRotation.y && cameraRotation.z == previousCameraRotation.z
+        && camRotX == previousCamRotX;
+
+    int lastX = screenWidth - 1;
+    int lastY = screenHeight - 1;
+    float pixelSize = fov / screenHeight;
+
+    for (int i = 0; i < screenHeight; i++)
+    {
+        // Rows above and below, held to the screen at the edges
+        int above = max(i - 1, 0);
+        int below = min(i + 1, lastY);
+
+        // Direction of the pixel's view ray with z = 1
+        float rayY = (0.5f * fov) - ((i + 0.5f) * pixelSize);
+
+        // Skip to the first pixel of the row that wasn't shaded
+        for (int j = ((i + checkerboardParity + 1) & 1); j < screenWidth; j += 2)
+        {
+            int index = PixelIndex(i, j);
+
+            // The four direct neighbours were all shaded this frame
+            RGBColor n0 = screenColorData[PixelIndex(above, j)];
+            RGBColor n1 = screenColorData[PixelIndex(below, j)];
+            RGBColor n2 = screenColorData[PixelIndex(i, max(j - 1, 0))];
+            RGBColor n3 = screenColorData[PixelIndex(i, min(j + 1, lastX))];
+
+            // Their range, to clamp the history to
+            int lowR = min(min(n0.r, n1.r), min(n2.r, n3.r));
+            int lowG = min(min(n0.g, n1.g), min(n2.g, n3.g));
+            int lowB = min(min(n0.b, n1.b), min(n2.b, n3.b));
+            int highR = max(max(n0.r, n1.r), max(n2.r, n3.r));
+            int highG = max(max(n0.g, n1.g), max(n2.g, n3.g));
+            int highB = max(max(n0.b, n1.b), max(n2.b, n3.b));
+
+            RGBColor result = {
+                uint8_t((n0.r + n1.r + n2.r + n3.r + 2) >> 2),
+                uint8_t((n0.g + n1.g + n2.g + n3.g + 2) >> 2),
+                uint8_t((n0.b + n1.b + n2.b + n3.b + 2) >> 2) };
+            float depth = StoredDepth(index);
+
+            if (reproject && depth > 0)
+            {
+                // Find where this pixel's surface was on the screen last frame.
+                // The point is kept multiplied by its depth, which saves dividing by depth to find z.
+                int previousIndex = index;
+                float previousZ = 1;
+
+                if (!cameraStill)
+                {
+                    float rayX = ((j + 0.5f) * pixelSize) - (0.5f * fov * aspectRatio);
+
+                    Vector3 previous = {
+                        origin.x * depth + (axisX.x * rayX + axisY.x * rayY + axisZ.x),
+                        origin.y * depth + (axisX.y * rayX + axisY.y * rayY + axisZ.y),
+                        origin.z * depth + (axisX.z * rayX + axisY.z * rayY + axisZ.z) };
+
+                    float scale = 1 / (previous.z * fov);
+                    int previousX = int((previous.x * scale / aspectRatio + 0.5f) * screenWidth);
+                    int previousY = int((-previous.y * scale + 0.5f) * screenHeight);
+
+                    if (previous.z < cameraNear * depth || previousX < 0 || previousX >= screenWidth || previousY < 0 || previousY >= screenHeight)
+                        previousIndex = -1;
+                    else
+                        previousIndex = PixelIndex(previousY, previousX);
+
+                    previousZ = previous.z;
+                }
+
+                // If something else was in front of the surface last frame, the history can't be used
+                if (previousIndex >= 0 && fabsf(previousDepth[previousIndex] * previousZ - depth) < 0.05f * depth)
+                {
+                    // Clamping to the neighbours hides most of the error from moving objects
+                    RGBColor history = previousColor[previousIndex];
+                    result = {
+                        uint8_t(max(lowR, min(int(history.r), highR))),
+                        uint8_t(max(lowG, min(int(history.g), highG))),
+                        uint8_t(max(lowB, min(int(history.b), highB))) };
+                }
+            }
+
+            screenColorData[index] = result;
+        }
+
+        if (!useHistory)
+            continue;
+
+        // Keep the finished row for the next frame while it is still in the cache
+        for (int j = 0; j < screenWidth; j++)
+        {
+            int index = PixelIndex(i, j);
+            savedColor[index] = screenColorData[index];
+            savedDepth[index] = StoredDepth(index);
+        }
+    }
+
+    if (!useHistory)
+        return;
+
+    // History is read while this frame is saved, so the two swap instead of being copied
+    swap(previousColor, savedColor);
+    swap(previousDepth, savedDepth);
+
+    historyValid = true;
+    historyWidth = screenWidth;
+    historyHeight = screenHeight;
+    previousCameraPosition = cameraPosition;
+    previousCameraRotation = cameraRotation;
+    previousCamRotX = camRotX;
+}
+
+
+Vector3 CameraToPreviousCamera(Vector3 vect)
+{
+    // Undo this frame's camera
+    vect = RotateInverse(vect, { 0, 0, camRotX });
+    vect = RotateInverse(vect, cameraRotation);
+    vect = Translate(vect, { -cameraPosition.x, -cameraPosition.y, -cameraPosition.z });
+
+    // Apply last frame's camera
+    vect = Translate(vect, previousCameraPosition);
+    vect = Rotate(vect, previousCameraRotation);
+    return Rotate(vect, { 0, 0, previousCamRotX });
+}
+
+
+void MarkDepthPrecisionErrors()
+{
+    for (int i = 0; i < screenHeight; i++)
+    {
+        for (int j = 0; j < screenWidth; j++)
+        {
+            // Pixels filled from the checkerboard history would differ from the reference's even with the same depth
+            if (SkipShading(i, j))
+                continue;
+
+            int p = PixelIndex(i, j);
+            RGBColor& col = screenColorData[p];
+            const RGBColor& reference = precisionReference[p];
+
+            if (col.r != reference.r || col.g != reference.g || col.b != reference.b)
+                col = { 255, uint8_t(col.g / 4), uint8_t(col.b / 4) };
+        }
+    }
+}
+
+
+
+void DrawScene()
+{
+    if (sortFrontToBack)
+    {
+        SortDrawOrder();
+
+        // Nearest clusters first, so hidden geometry fails the depth test before it is shaded
+        for (int d = 0; d < drawOrder.size(); d++)
+        {
+            const MeshCluster& cluster = loadedMeshes.at(drawOrder[d].instance).clusters[drawOrder[d].cluster];
+
+            for (int j = cluster.firstTri; j < cluster.firstTri + cluster.triCount; j++)
+                DrawMeshTriangle(drawOrder[d].instance, j);
+        }
+        return;
+    }
+
+    for (int i = 0; i < loadedMeshInstances.size(); i++)
+    {
+        for (int j = 0; j < loadedMeshInstances.at(i).instanceMesh.tris.size(); j++)
+        {
+            DrawMeshTriangle(i, j);
+        }
+    }
+}
+
+
+void DrawMeshTriangle(int i, int j)
+{
+    Triangle worldPoint = loadedMeshes.at(i).tris[j];
+
+    
+
+    worldPoint.p[0].coord = Rotate(worldPoint.p[0].coord, loadedMeshInstances.at(i).rotation);
+    worldPoint.p[1].coord = Rotate(worldPoint.p[1].coord, loadedMeshInstances.at(i).rotation);
+    worldPoint.p[2].coord = Rotate(worldPoint.p[2].coord, loadedMeshInstances.at(i).rotation);
+
+
+    // Apply object transformations and rotations
+    worldPoint.p[0].coord = Translate(worldPoint.p[0].coord, loadedMeshInstances.at(i).position);
+    worldPoint.p[1].coord = Translate(worldPoint.p[1].coord, loadedMeshInstances.at(i).position);
+    worldPoint.p[2].coord = Translate(worldPoint.p[2].coord, loadedMeshInstances.at(i).position);
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////
+    worldPoint.p[0].coord = Translate(worldPoint.p[0].coord, globalLightPosition);
+    worldPoint.p[1].coord = Translate(worldPoint.p[1].coord, globalLightPosition);
+    worldPoint.p[2].coord = Translate(worldPoint.p[2].coord, globalLightPosition);
+
+    if (!globalLightingFacingCamera)
+    {
+        float lightingNormal = CalculateNormal(worldPoint);
+
+        worldPoint.lighting = (lightingNormal + 1) * 100;
+    }
+
+    worldPoint.p[0].coord = Translate(worldPoint.p[0].coord, { -globalLightPosition.x, -globalLightPosition.y, -globalLightPosition.z });
+    worldPoint.p[1].coord = Translate(worldPoint.p[1].coord, { -globalLightPosition.x, -globalLightPosition.y, -globalLightPosition.z });
+    worldPoint.p[2].coord = Translate(worldPoint.p[2].coord, { -globalLightPosition.x, -globalLightPosition.y, -globalLightPosition.z });
+    /////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    
+
+    worldPoint.p[0].coord = Translate(worldPoint.p[0].coord, cameraPosition);
+    worldPoint.p[1].coord = Translate(worldPoint.p[1].coord, cameraPosition);
+    worldPoint.p[2].coord = Translate(worldPoint.p[2].coord, cameraPosition);
+
+    
+
+    float dotProduct = CalculateNormal(worldPoint);
+
+    loadedMeshInstances.at(i).frontFacing[j] = dotProduct < 0;
+
+    // Draw the projected triangle.
+    if (dotProduct < 0)
+    {     
+        // Rotate each triangle to match camera space, and then project it.
+
+        Vector3 rot = Rotate(cameraRotation, { 0, 0, camRotX });
+
+        worldPoint.p[0].coord = Rotate(worldPoint.p[0].coord, cameraRotation);
+        worldPoint.p[1].coord = Rotate(worldPoint.p[1].coord, cameraRotation);
+        worldPoint.p[2].coord = Rotate(worldPoint.p[2].coord, cameraRotation);
+
+        worldPoint.p[0].coord = Rotate(worldPoint.p[0].coord, { 0, 0, camRotX });
+        worldPoint.p[1].coord = Rotate(worldPoint.p[1].coord, { 0, 0, camRotX });
+        worldPoint.p[2].coord = Rotate(worldPoint.p[2].coord, { 0, 0, camRotX });
+        
+
+        if (faceLighting)
+        {
+            if (globalLightingFacingCamera)
+            {
+                worldPoint.lighting = (dotProduct + 1) * 100;
+            }
+        }
+
+        currentInstance = i;
+
+        // Binding only changes between meshes
+        const Texture* texture = &loadedTextures[loadedMeshes.at(i).texture];
+
+        if (boundTexture.texture != texture)
+            BindTexture(texture);
+
+        ClipAndDraw(worldPoint);
+    }
+}
+
+
+Vector3 InstanceToCamera(Vector3 vect, const MeshInstance& instance)
+{
+    vect = Rotate(vect, instance.rotation);
+    vect = Translate(vect, instance.position);
+    vect = Translate(vect, cameraPosition);
+    vect = Rotate(vect, cameraRotation);
+    return Rotate(vect, { 0, 0, camRotX });
+}
+
+
+void SortDrawOrder()
+{
+    drawOrder.clear();
+    drawOrderDepths.clear();
+
+    float nearest = 0;
+    float furthest = 0;
+
+    for (int i = 0; i < loadedMeshInstances.size(); i++)
+    {
+        const Mesh& mesh = loadedMeshes.at(i);
+
+        for (int c = 0; c < mesh.clusters.size(); c++)
+        {
+            float viewDepth = InstanceToCamera(mesh.clusters[c].center, loadedMeshInstances[i]).z;
+
+            if (drawOrder.empty() || viewDepth < nearest)
+                nearest = viewDepth;
+            if (drawOrder.empty() || viewDepth > furthest)
+                furthest = viewDepth;
+
+            DrawItem item;
+            item.instance = i;
+            item.cluster = c;
+            drawOrder.emplace_back(item);
+            drawOrderDepths.emplace_back(viewDepth);
+        }
+    }
+
+    // Quantize the depths over this frame's range into 16-bit keys
+    float keyScale = furthest > nearest ? 65535 / (furthest - nearest) : 0;
+
+    for (int d = 0; d < drawOrder.size(); d++)
+        drawOrder[d].key = uint16_t((drawOrderDepths[d] - nearest) * keyScale);
+
+    // Least significant digit radix sort, one pass per byte of the key
+    drawOrderScratch.resize(drawOrder.size());
+
+    for (int shift = 0; shift < 16; shift += 8)
+    {
+        int offsets[256] = {};
+
+        for (int d = 0; d < drawOrder.size(); d++)
+            offsets[(drawOrder[d].key >> shift) & 255]++;
+
+        int total = 0;
+        for (int b = 0; b < 256; b++)
+        {
+            int count = offsets[b];
+            offsets[b] = total;
+            total += count;
+        }
+
+        for (int d = 0; d < drawOrder.size(); d++)
+            drawOrderScratch[offsets[(drawOrder[d].key >> shift) & 255]++] = drawOrder[d];
+
+        swap(drawOrder, drawOrderScratch);
+    }
+}
+
+
+
+void UpdatePhysics(float delta)
+{
+    Vector3 rotatedVelocity = cameraVelocity;
+
+    rotatedVelocity = Rotate(rotatedVelocity, { 0, -cameraRotation.y, 0 });
+
+    cameraPosition.x += rotatedVelocity.x * 0.03 * delta;
+    cameraPosition.y += rotatedVelocity.y * 0.03 * delta;
+    cameraPosition.z += rotatedVelocity.z * 0.03 * delta;
+
+
+    cameraRotation.y += cameraRotVelocity * 0.08 * delta;
+    camRotX += cameraRotXVelocity * 0.08 * delta;
+
+    if (cameraVelocity.x != 0 || cameraVelocity.y != 0 || cameraVelocity.z != 0 || cameraRotVelocity != 0 || cameraRotXVelocity != 0)
+        InvalidateFrame();
+    
+
+    // Set rotation to wrap
+    if (cameraRotation.x > 6.283185)
+        cameraRotation.x -= 6.283185;
+    if (cameraRotation.x < 0)
+        cameraRotation.x += 6.283185;
+    if (cameraRotation.y > 6.283185)
+        cameraRotation.y -= 6.283185;
+    if (cameraRotation.y < 0)
+        cameraRotation.y += 6.283185;
+
+
+    // Spin the model
+    if (spinModel)
+    {
+        InvalidateFrame();
+
+        // Every mesh of the model turns together
+        for (int i = 0; i < loadedMeshInstances.size(); i++)
+        {
+            loadedMeshInstances[i].rotation.y += 0.0005 * delta;
+            if (loadedMeshInstances[i].rotation.y > 6.283185)
+                loadedMeshInstances[i].rotation.y -= 6.283185;
+        }
+    }
+}
+
+
+
+void Blur(int x, int y)
+{
+    // Only blur far pixels
+    if (IsFarPixel(PixelIndex(y, x)))
+    {
+        // The number of pixels that will be blurred together
+        float blurredPixels = 0;
+        float combinedR = 0;
+        float combinedG = 0;
+        float combinedB = 0;
+
+        for (int i = -blurSize; i <= blurSize; i++)
+        {
+            for (int j = -blurSize; j <= blurSize; j++)
+            {
+                if ((i + y < 0) || (i + y >= screenHeight) || (j + x < 0) || (j + x >= screenWidth))
+                    continue;
+
+                int index = PixelIndex(y + i, x + j);
+
+                if (IsFarPixel(index))
+                {
+                    const RGBColor& neighbour = screenColorData[index];
+
+                    float blurAmount = (blurSize - abs(float(i) / blurSize)) * (blurSize - abs(float(j) / blurSize));
+                    combinedR += neighbour.r * blurAmount;
+                    combinedG += neighbour.g * blurAmount;
+                    combinedB += neighbour.b * blurAmount;
+
+                    blurredPixels += blurAmount;
+                }
+            }
+        }
+
+        float blurDiv = 1 / blurredPixels;
+
+        combinedR *= blurDiv;
+        combinedG *= blurDiv;
+        combinedB *= blurDiv;
+
+        // Add the colors together
+        screenColorData[PixelIndex(y, x)] = { uint8_t(combinedR), uint8_t(combinedG), uint8_t(combinedB) };
+
+        return;
+    }
+    else
+        return;
+}
+
+
+
+inline uint32_t PackColor(RGBColor color)
+{
+    return uint32_t(color.r) | (uint32_t(color.g) << 8) | (uint32_t(color.b) << 16) | (uint32_t(color.a) << 24);
+}
+
+
+template <int wrapMode, bool compressed>
+RGBColor Filter(float x, float y, int level)
+{
+    // See-through texels hold the colors of their solid neighbours, so all four samples are blended as they are.
+    // The coverage mask has already been checked, so nothing here discards.
+
+    // Find the pixels around the sampled pixel.
+    // In fixed point with 8 fractional bits, which are the weights of the right and upper samples in 256ths.
+    int fixedX = FloorToInt((x - 0.5f) * 256);
+    int fixedY = FloorToInt((y - 0.5f) * 256);
+
+    int fx = fixedX & 255;
+    int fy = fixedY & 255;
+
+    const LevelBinding& binding = boundTexture.levels[level];
+
+    int x0 = fixedX >> 8;
+    int y0 = fixedY >> 8;
+    int x1 = x0 + 1;
+    int y1 = y0 + 1;
+
+    // Most samples lie wholly inside the texture and need no wrapping.
+    // Otherwise each sample is wrapped on its own, so the samples on either side of an edge can come from opposite sides of the texture.
+    if (unsigned(x0) >= unsigned(binding.width - 1) || unsigned(y0) >= unsigned(binding.height - 1))
+    {
+        x0 = WrapTexel<wrapMode>(x0, binding.width);
+        y0 = WrapTexel<wrapMode>(y0, binding.height);
+        x1 = WrapTexel<wrapMode>(x1, binding.width);
+        y1 = WrapTexel<wrapMode>(y1, binding.height);
+    }
+
+    // With the texels in 4x4 blocks, most of the samples come from the same cache line, or the same decoded block,
+    // whichever way the texture lies
+    uint32_t sample1 = PackColor(FetchTexel<compressed>(binding, x0, y0));
+    uint32_t sample2 = PackColor(FetchTexel<compressed>(binding, x1, y0));
+    uint32_t sample3 = PackColor(FetchTexel<compressed>(binding, x0, y1));
+    uint32_t sample4 = PackColor(FetchTexel<compressed>(binding, x1, y1));
+
+    uint32_t blended;
+
+#ifdef USE_SSE2
+    // Each channel of a pair of samples sits side by side in 16 bit lanes, so one multiply-add blends a whole row
+    __m128i zero = _mm_setzero_si128();
+    __m128i bottom = _mm_unpacklo_epi8(_mm_unpacklo_epi8(_mm_cvtsi32_si128(int(sample1)), _mm_cvtsi32_si128(int(sample2))), zero);
+    __m128i top = _mm_unpacklo_epi8(_mm_unpacklo_epi8(_mm_cvtsi32_si128(int(sample3)), _mm_cvtsi32_si128(int(sample4))), zero);
+    __m128i round = _mm_set1_epi32(128);
+
+    __m128i weightX = _mm_set1_epi32(((fx) << 16) | (256 - fx));
+    __m128i bottomRow = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(bottom, weightX), round), 8);
+    __m128i topRow = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(top, weightX), round), 8);
+
+    // Then the channels of the two rows are paired up and blended the same way
+    __m128i rows = _mm_packs_epi32(bottomRow, topRow);
+    __m128i columns = _mm_unpacklo_epi16(rows, _mm_srli_si128(rows, 8));
+
+    __m128i weightY = _mm_set1_epi32(((fy) << 16) | (256 - fy));
+    __m128i color = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(columns, weightY), round), 8);
+
+    color = _mm_packs_epi32(color, color);
+    blended = uint32_t(_mm_cvtsi128_si32(_mm_packus_epi16(color, color)));
+#else
+    // The same blend a channel at a time
+    blended = 0;
+
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        uint32_t bottomRow = ((((sample1 >> shift) & 255) * (256 - fx)) + (((sample2 >> shift) & 255) * fx) + 128) >> 8;
+        uint32_t topRow = ((((sample3 >> shift) & 255) * (256 - fx)) + (((sample4 >> shift) & 255) * fx) + 128) >> 8;
+
+        blended |= (((bottomRow * (256 - fy)) + (topRow * fy) + 128) >> 8) << shift;
+    }
+#endif
+
+    return { uint8_t(blended), uint8_t(blended >> 8), uint8_t(blended >> 16), uint8_t(blended >> 24) };
+}
+
+
+RGBColor FilterBloom(float x, float y)
+{
+    // Wrap the coordinates on the texture for tiling
+
+
+    // find the distance the point is between pixels so add weight to each sample for filtering
+    // Use the wrapped coordinates to find the correct pixel on the texture
+
+
+    // Find the pixels around the sampled pixel
+    x -= 0.5;
+    y -= 0.5;
+
+    int roundDownX = (x);
+    int roundDownY = (y);
+    int roundUpX = (x + 1);
+    int roundUpY = (y + 1);
+
+    if (roundUpX >= 32)
+        roundUpX = 31;
+    if (roundUpY >= 32)
+        roundUpY = 31;
+    if (roundDownX < 0)
+        roundDownX = 0;
+    if (roundDownY < 0)
+        roundDownY = 0;
+
+    RGBFloat sample1 = bloomTexture.px[roundDownX + (roundDownY * 32)];
+    RGBFloat sample2 = bloomTexture.px[roundUpX + (roundDownY * 32)];
+    RGBFloat sample3 = bloomTexture.px[roundDownX + (roundUpY * 32)];
+    RGBFloat sample4 = bloomTexture.px[roundUpX + (roundUpY * 32)];
+
+    float offset_x = (x - roundDownX);
+    float offset_y = (y - roundDownY);
+    float totalOffset = offset_x * offset_y;
+
+    sample1.r *= (1 - offset_x - offset_y + totalOffset);
+    sample1.g *= (1 - offset_x - offset_y + totalOffset);
+    sample1.b *= (1 - offset_x - offset_y + totalOffset);
+
+    sample2.r *= offset_x - totalOffset;
+    sample2.g *= offset_x - totalOffset;
+    sample2.b *= offset_x - totalOffset;
+
+    sample3.r *= offset_y - totalOffset;
+    sample3.g *= offset_y - totalOffset;
+    sample3.b *= offset_y - totalOffset;
+
+    sample4.r *= totalOffset;
+    sample4.g *= totalOffset;
+    sample4.b *= totalOffset;
+
+    // Add the colors together
+    return { uint8_t(sample1.r + sample2.r + sample3.r + sample4.r), uint8_t(sample1.g + sample2.g + sample3.g + sample4.g), uint8_t(sample1.b + sample2.b + sample3.b + sample4.b) };
+}
+
+
+float CalculateNormal(Triangle tri)
+{
+    // Use Cross Product formula to find the normal of the triangle. Only draw triangles with a normal facing the camera
+
+    Vector3 normal;
+    normal.x = ((tri.p[1].coord.y - tri.p[0].coord.y) * (tri.p[2].coord.z - tri.p[0].coord.z)) - ((tri.p[1].coord.z - tri.p[0].coord.z) * (tri.p[2].coord.y - tri.p[0].coord.y));
+    normal.y = ((tri.p[1].coord.z - tri.p[0].coord.z) * (tri.p[2].coord.x - tri.p[0].coord.x)) - ((tri.p[1].coord.x - tri.p[0].coord.x) * (tri.p[2].coord.z - tri.p[0].coord.z));
+    normal.z = ((tri.p[1].coord.x - tri.p[0].coord.x) * (tri.p[2].coord.y - tri.p[0].coord.y)) - ((tri.p[1].coord.y - tri.p[0].coord.y) * (tri.p[2].coord.x - tri.p[0].coord.x));
+
+    // Normalize the face's normal vector
+
+    float vecLength = 1 / sqrt(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+    normal.x *= vecLength;
+    normal.y *= vecLength;
+    normal.z *= vecLength;
+
+    Vector3 vec3;
+    float vecLength2 = 1 / sqrt(tri.p[0].coord.x * tri.p[0].coord.x + tri.p[0].coord.y * tri.p[0].coord.y + tri.p[0].coord.z * tri.p[0].coord.z);
+    vec3.x = tri.p[0].coord.x * vecLength2;
+    vec3.y = tri.p[0].coord.y * vecLength2;
+    vec3.z = tri.p[0].coord.z * vecLength2;
+
+    // Return the dot product
+    return (normal.x * vec3.x) + (normal.y * vec3.y) + (normal.z * vec3.z);
+}
+
+
+
+void LoadAssets()
+{
+    // Load textures
+    if (LoadTexture("testTexture.png") != 0)
+    {
+        // Without the default texture, meshes are drawn with a single black texel
+        Texture blank;
+        SingleTexelTexture(blank, { 0, 0, 0 });
+        loadedTextures.emplace_back(blank);
+    }
+
+
+    // Initialize Loader
+    objl::Loader Loader;
+
+    // Load .obj File
+    string modelPath = "testModel.obj";
+    bool isLoaded = Loader.LoadFile(modelPath);
+
+    // Texture paths in the material file are relative to the model
+    string modelFolder = modelPath.substr(0, modelPath.find_last_of("/\\") + 1);
+
+    if (isLoaded)
+    {
+        vector<Mesh> modelMeshes; // One for each material of the model
+        for (int i = 0; i < Loader.LoadedMeshes.size(); i++)
+        {
+            objl::MeshData currentMesh = Loader.LoadedMeshes[i];
+            Mesh newMesh;
+
+            // Meshes keep the default texture if their material has none, or it can't be read
+            string textureMap = currentMesh.MeshMaterial.map_Kd;
+
+            if (!textureMap.empty())
+            {
+                // Material textures repeat unless they have the -clamp option, the only option read
+                int wrapMode = WRAP_REPEAT;
+
+                if (textureMap.compare(0, 10, "-clamp on ") == 0)
+                {
+                    wrapMode = WRAP_CLAMP;
+                    textureMap = textureMap.substr(10);
+                }
+                else if (textureMap.compare(0, 11, "-clamp off ") == 0)
+                {
+                    textureMap = textureMap.substr(11);
+                }
+
+                int texture = LoadTexture(modelFolder + textureMap);
+
+                if (texture >= 0)
+                {
+                    newMesh.texture = texture;
+                    loadedTextures[texture].wrapMode = wrapMode;
+                }
+            }
+
+            for (int j = 0; j < currentMesh.Indices.size(); j += 3)
+            {
+                Triangle newTri;
+                newTri.p[0].coord.x = currentMesh.Vertices[currentMesh.Indices[j]].Position.X;
+                newTri.p[0].coord.y = currentMesh.Vertices[currentMesh.Indices[j]].Position.Y;
+                newTri.p[0].coord.z = currentMesh.Vertices[currentMesh.Indices[j]].Position.Z;
+                newTri.p[1].coord.x = currentMesh.Vertices[currentMesh.Indices[j + 1]].Position.X;
+                newTri.p[1].coord.y = currentMesh.Vertices[currentMesh.Indices[j + 1]].Position.Y;
+                newTri.p[1].coord.z = currentMesh.Vertices[currentMesh.Indices[j + 1]].Position.Z;
+                newTri.p[2].coord.x = currentMesh.Vertices[currentMesh.Indices[j + 2]].Position.X;
+                newTri.p[2].coord.y = currentMesh.Vertices[currentMesh.Indices[j + 2]].Position.Y;
+                newTri.p[2].coord.z = currentMesh.Vertices[currentMesh.Indices[j + 2]].Position.Z;
+
+                newTri.p[0].uv.u = currentMesh.Vertices[currentMesh.Indices[j]].TextureCoordinate.X;
+                newTri.p[0].uv.v = currentMesh.Vertices[currentMesh.Indices[j]].TextureCoordinate.Y;
+                newTri.p[1].uv.u = currentMesh.Vertices[currentMesh.Indices[j + 1]].TextureCoordinate.X;
+                newTri.p[1].uv.v = currentMesh.Vertices[currentMesh.Indices[j + 1]].TextureCoordinate.Y;
+                newTri.p[2].uv.u = currentMesh.Vertices[currentMesh.Indices[j + 2]].TextureCoordinate.X;
+                newTri.p[2].uv.v = currentMesh.Vertices[currentMesh.Indices[j + 2]].TextureCoordinate.Y;
+
+                newTri.p[0].light.r = 255 - currentMesh.Vertices[currentMesh.Indices[j]].Color.X * 255;
+                newTri.p[0].light.g = 255 - currentMesh.Vertices[currentMesh.Indices[j]].Color.Y * 255;
+                newTri.p[0].light.b = 255 - currentMesh.Vertices[currentMesh.Indices[j]].Color.Z * 255;
+                newTri.p[1].light.r = 255 - currentMesh.Vertices[currentMesh.Indices[j + 1]].Color.X * 255;
+                newTri.p[1].light.g = 255 - currentMesh.Vertices[currentMesh.Indices[j + 1]].Color.Y * 255;
+                newTri.p[1].light.b = 255 - currentMesh.Vertices[currentMesh.Indices[j + 1]].Color.Z * 255;
+                newTri.p[2].light.r = 255 - currentMesh.Vertices[currentMesh.Indices[j + 2]].Color.X * 255;
+                newTri.p[2].light.g = 255 - currentMesh.Vertices[currentMesh.Indices[j + 2]].Color.Y * 255;
+                newTri.p[2].light.b = 255 - currentMesh.Vertices[currentMesh.Indices[j + 2]].Color.Z * 255;
+
+                newMesh.tris.emplace_back(newTri);
+            }
+
+            modelMeshes.emplace_back(newMesh);
+        }
+
+        AddModel(modelMeshes);
+    }
+}
+
+
+void AddModel(vector<Mesh>& meshes)
+{
+    // Switching textures between materials is slow, so as many as can share an atlas are drawn as one mesh
+    BuildAtlas(meshes);
+
+    // The merged mesh and the meshes left out of the atlas are all drawn, each with its own instance
+    for (int i = 0; i < meshes.size(); i++)
+    {
+        BuildClusters(meshes[i]);
+        BuildEdges(meshes[i]);
+        loadedMeshes.emplace_back(meshes[i]);
+
+        MeshInstance newInstance;
+        newInstance.instanceMesh = loadedMeshes.back();
+        newInstance.frontFacing.resize(loadedMeshes.back().tris.size());
+        loadedMeshInstances.emplace_back(newInstance);
+    }
+}
+
+
+bool CheckModelMeshes()
+{
+    size_t textureCount = loadedTextures.size();
+    size_t meshCount = loadedMeshes.size();
+
+    // Red and green fit in an atlas together, blue repeats across its triangle so it keeps its own texture
+    const RGBColor colors[3] = { { 255, 0, 0 }, { 0, 255, 0 }, { 0, 0, 255 } };
+    vector<Mesh> meshes(3);
+
+    for (int m = 0; m < 3; m++)
+    {
+        Texture texture;
+        SingleTexelTexture(texture, colors[m]);
+        texture.wrapMode = WRAP_REPEAT;
+        loadedTextures.emplace_back(move(texture));
+
+        float repeats = (m == 2) ? 4.0f : 1.0f;
+        Triangle tri;
+        tri.p[0].coord = { float(m), 0, 5 };
+        tri.p[1].coord = { float(m) + 1, 0, 5 };
+        tri.p[2].coord = { float(m), 1, 5 };
+        tri.p[0].uv = { 0, 0 };
+        tri.p[1].uv = { repeats, 0 };
+        tri.p[2].uv = { 0, repeats };
+
+        meshes[m].texture = int(textureCount) + m;
+        meshes[m].tris.emplace_back(tri);
+    }
+
+    AddModel(meshes);
+
+    // Look up the texel at the middle of each triangle that will be drawn, and find which color it is
+    bool drawn[3] = {};
+    int atlases = 0;
+
+    for (size_t i = meshCount; i < loadedMeshInstances.size(); i++)
+    {
+        const Mesh& mesh = loadedMeshes[i];
+        const Texture& texture = loadedTextures[mesh.texture];
+        LevelBinding level;
+        level.blocksX = texture.levels[0].blocksX;
+
+        atlases += mesh.texture >= int(textureCount) + 3;
+
+        for (int t = 0; t < mesh.tris.size(); t++)
+        {
+            const Triangle& tri = mesh.tris[t];
+            float u = (tri.p[0].uv.u + tri.p[1].uv.u + tri.p[2].uv.u) / 3;
+            float v = (tri.p[0].uv.v + tri.p[1].uv.v + tri.p[2].uv.v) / 3;
+            int x = ((int(floorf(u * texture.width)) % texture.width) + texture.width) % texture.width;
+            int y = ((int(floorf(v * texture.height)) % texture.height) + texture.height) % texture.height;
+            RGBColor texel = texture.levels[0].px[TexelAddress(level, x, y)];
+
+            for (int m = 0; m < 3; m++)
+                drawn[m] |= texel.r == colors[m].r && texel.g == colors[m].g && texel.b == colors[m].b;
+        }
+    }
+
+    bool passed = atlases == 1 && drawn[0] && drawn[1] && drawn[2];
+
+    while (loadedMeshInstances.size() > meshCount)
+        loadedMeshInstances.pop_back();
+    while (loadedMeshes.size() > meshCount)
+        loadedMeshes.pop_back();
+    while (loadedTextures.size() > textureCount)
+        loadedTextures.pop_back();
+
+    return passed;
+}
+
+
+void BuildClusters(Mesh& mesh)
+{
+    // Triangles in a model file are mostly stored near their neighbours, so runs of them make compact clusters
+    for (int first = 0; first < mesh.tris.size(); first += clusterSize)
+    {
+        MeshCluster cluster;
+        cluster.firstTri = first;
+        cluster.triCount = min(clusterSize, int(mesh.tris.size()) - first);
+
+        Vector3 low = mesh.tris[first].p[0].coord;
+        Vector3 high = low;
+
+        for (int j = first; j < first + cluster.triCount; j++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                const Vector3& coord = mesh.tris[j].p[k].coord;
+                low = { min(low.x, coord.x), min(low.y, coord.y), min(low.z, coord.z) };
+                high = { max(high.x, coord.x), max(high.y, coord.y), max(high.z, coord.z) };
+            }
+        }
+
+        cluster.center = { (low.x + high.x) * 0.5f, (low.y + high.y) * 0.5f, (low.z + high.z) * 0.5f };
+        mesh.clusters.emplace_back(cluster);
+    }
+}
+
+
+void BuildEdges(Mesh& mesh)
+{
+    // Triangles don't share vertices, so edges are matched by the positions of their ends
+    struct EdgeKey
+    {
+        array<float, 6> ends;
+        MeshEdge edge;
+    };
+
+    vector<EdgeKey> keys;
+
+    for (int j = 0; j < mesh.tris.size(); j++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            EdgeKey key;
+            key.edge.tri = j;
+            key.edge.a = k;
+            key.edge.b = (k + 1) % 3;
+
+            Vector3 a = mesh.tris[j].p[key.edge.a].coord;
+            Vector3 b = mesh.tris[j].p[key.edge.b].coord;
+
+            // The same edge is walked in opposite directions by its two triangles
+            array<float, 3> first = { a.x, a.y, a.z };
+            array<float, 3> second = { b.x, b.y, b.z };
+
+            if (second < first)
+                swap(first, second);
+
+            key.ends = { first[0], first[1], first[2], second[0], second[1], second[2] };
+            keys.emplace_back(key);
+        }
+    }
+
+    sort(keys.begin(), keys.end(), [](const EdgeKey& l, const EdgeKey& r) { return l.ends < r.ends; });
+
+    for (int n = 0; n < keys.size(); n++)
+    {
+        MeshEdge edge = keys[n].edge;
+
+        if (n + 1 < keys.size() && keys[n + 1].ends == keys[n].ends)
+        {
+            edge.otherTri = keys[n + 1].edge.tri;
+
+            // Skip every other copy of the edge
+            while (n + 1 < keys.size() && keys[n + 1].ends == keys[n].ends)
+                n++;
+        }
+
+        mesh.edges.emplace_back(edge);
+    }
+}
+
+
+Vector3 Translate(Vector3 vect, Vector3 vect2)
+{
+    vect.x += vect2.x;
+    vect.y += vect2.y;
+    vect.z += vect2.z;
+
+    return vect;
+}
+
+
+Vector3 Rotate(Vector3 vect, Vector3 rot)
+{
+    Vector3 returnVect;
+
+    returnVect.x = vect.x * (cos(rot.y) * cos(rot.x)) +
+        vect.y * (sin(rot.z) * sin(rot.y) * cos(rot.x) - cos(rot.z) * sin(rot.x)) +
+        vect.z * (cos(rot.z) * sin(rot.y) * cos(rot.x) + sin(rot.z) * sin((rot.x)));
+    
+    returnVect.y = vect.x * (cos(rot.y) * sin(rot.x)) +
+        vect.y * (sin(rot.z) * sin(rot.y) * sin(rot.x) + cos(rot.z) * cos(rot.x)) +
+        vect.z * (cos(rot.z) * sin(rot.y) * sin(rot.x) - sin(rot.z) * cos((rot.x)));
+
+    returnVect.z = vect.x * (-sin(rot.y)) +
+        vect.y * (sin(rot.z) * cos(rot.y)) +
+        vect.z * (cos(rot.z) * cos(rot.y));
+
+    return returnVect;
+}
+
+
+Vector3 RotateInverse(Vector3 vect, Vector3 rot)
+{
+    // The inverse of a rotation matrix is its transpose
+    Vector3 returnVect;
+
+    returnVect.x = vect.x * (cos(rot.y) * cos(rot.x)) +
+        vect.y * (cos(rot.y) * sin(rot.x)) +
+        vect.z * (-sin(rot.y));
+
+    returnVect.y = vect.x * (sin(rot.z) * sin(rot.y) * cos(rot.x) - cos(rot.z) * sin(rot.x)) +
+        vect.y * (sin(rot.z) * sin(rot.y) * sin(rot.x) + cos(rot.z) * cos(rot.x)) +
+        vect.z * (sin(rot.z) * cos(rot.y));
+
+    returnVect.z = vect.x * (cos(rot.z) * sin(rot.y) * cos(rot.x) + sin(rot.z) * sin((rot.x))) +
+        vect.y * (cos(rot.z) * sin(rot.y) * sin(rot.x) - sin(rot.z) * cos((rot.x))) +
+        vect.z * (cos(rot.z) * cos(rot.y));
+
+    return returnVect;
+}
+
+
+void ClipAndDraw(Triangle tri)
+{
+    // Clips triangles against one plane at a time.
+    // Each time it is clipped, clip each of the resulting triangles against the next plane.
+
+
+    // Clip near
+    vector <Triangle> newTris1; // Create and the new triangles generated from clipping
+    vector <Point> newPoints1; // Clipped points from which new triangles will be constructed
+
+    for (int p1 = 0; p1 < 3; p1++)
+    {
+        // If the point is inside screen, include it in newPoints.
+        if (tri.p[p1].coord.z >= cameraNear)
+            newPoints1.emplace_back(tri.p[p1]);
+
+        int p2 = p1 + 1;
+        if (p2 > 2)
+            p2 = 0;
+
+        Point point1 = tri.p[p1];
+        Point point2 = tri.p[p2];
+
+        if (point1.coord.z > point2.coord.z) // p1 has the smaller y.
+            swap(point1, point2);
+
+        // Z intersection
+        if (point1.coord.z < cameraNear && point2.coord.z > cameraNear) // Line has points on either side of edge
+        {
+            float a = -(point1.coord.z - cameraNear) / ((point2.coord.z - cameraNear) - (point1.coord.z - cameraNear));
+
+            Point newP;
+
+            newP.coord.x = point2.coord.x * a + point1.coord.x * (1 - a);
+            newP.coord.y = point2.coord.y * a + point1.coord.y * (1 - a);
+            newP.coord.z = cameraNear;
+
+            newP.uv.u = point2.uv.u * a + point1.uv.u * (1 - a);
+            newP.uv.v = point2.uv.v * a + point1.uv.v * (1 - a);
+
+            newP.light.r = point2.light.r * a + point1.light.r * (1 - a);
+            newP.light.g = point2.light.g * a + point1.light.g * (1 - a);
+            newP.light.b = point2.light.b * a + point1.light.b * (1 - a);
+
+            newPoints1.emplace_back(newP);
+        }
+    }
+
+    for (int i = 0; i < newPoints1.size(); i++)
+    {
+        // fov covers the height of the screen, and the width is wider by the aspect ratio
+        newPoints1[i].coord.x = newPoints1[i].coord.x / (newPoints1[i].coord.z * fov * aspectRatio) + 0.5;
+        newPoints1[i].coord.y = -newPoints1[i].coord.y / (newPoints1[i].coord.z * fov) + 0.5;
+        newPoints1[i].coord.z = 1 / newPoints1[i].coord.z;
+    }
+
+    if (newPoints1.size() > 2)
+    {
+        for (int i = 0; i < newPoints1.size() - 2; i++)
+        {
+            if (!((newPoints1[0].coord.x < 0 && newPoints1[i + 1].coord.x < 0 && newPoints1[i + 2].coord.x < 0) ||
+                (newPoints1[0].coord.x > 1 && newPoints1[i + 1].coord.x > 1 && newPoints1[i + 2].coord.x > 1) ||
+                (newPoints1[0].coord.y < 0 && newPoints1[i + 1].coord.y < 0 && newPoints1[i + 2].coord.y < 0) ||
+                (newPoints1[0].coord.y > 1 && newPoints1[i + 1].coord.y > 1 && newPoints1[i + 2].coord.y > 1)))
+            {
+                Triangle newTri = { newPoints1[0], newPoints1[i + 1], newPoints1[i + 2] };
+                newTri.lighting = tri.lighting;
+                newTris1.emplace_back(newTri);
+            }
+        }
+    }
+    else
+        return; // Draw nothing
+    
+
+    for (int i = 0; i < newTris1.size(); i++)
+    {
+        DrawTriangle(newTris1[i]);
+    }
+}
+
+
+int LoadTexture(const string& path)
+{
+    for (int t = 0; t < loadedTextures.size(); t++)
+        if (loadedTextures[t].path == path)
+            return t;
+
+    // Only the header is read to find the size
+    int width, height, comps;
+
+    if (!stbi_info(path.c_str(), &width, &height, &comps))
+        return -1;
+
+    Texture texture;
+
+    if (width > atlasMaxTextureSize || height > atlasMaxTextureSize)
+    {
+        SingleTexelTexture(texture, { 128, 128, 128 });
+        texture.path = path;
+        texture.streamed = true;
+        texture.placeholder = true;
+        loadedTextures.emplace_back(move(texture));
+        RequestTexture(int(loadedTextures.size()) - 1);
+
+        return int(loadedTextures.size()) - 1;
+    }
+
+    if (!DecodeTexture(path, texture))
+        return -1;
+
+    loadedTextures.emplace_back(move(texture));
+
+    return int(loadedTextures.size()) - 1;
+}
+
+
+bool DecodeTexture(const string& path, Texture& texture, int levelCount)
+{
+    int width, height, comps;
+    unsigned char* texData = stbi_load(path.c_str(), &width, &height, &comps, 3);
+
+    if (!texData)
+    {
+        texture.levels.clear();
+        return false;
+    }
+
+    // Blocks the texture already has were encoded from the same texels, so they're kept instead of being encoded again
+    vector<TextureLevel> kept = move(texture.levels);
+
+    texture.path = path;
+    texture.width = width;
+    texture.height = height;
+    texture.levels.resize(1);
+    texture.levels[0].width = width;
+    texture.levels[0].height = height;
+    texture.levels[0].px.resize(size_t(width) * height);
+
+    // Images are stored from the top row down
+    for (int i = 0; i < width * height; i++)
+    {
+        unsigned char* pixelOffset = texData + (i) * 3;
+
+        RGBColor pixel = { pixelOffset[0], pixelOffset[1], pixelOffset[2] };
+
+        texture.levels[0].px[(height - 1 - i / width) * width + (i % width)] = pixel;
+    }
+
+    stbi_image_free(texData);
+
+    BuildCoverageMask(texture);
+    BuildMipLevels(texture, levelCount);
+
+    for (int l = 0; l < texture.levels.size(); l++)
+    {
+        StoreInBlocks(texture.levels[l]);
+
+        if (l < kept.size())
+            texture.levels[l].compressed = move(kept[l].compressed);
+    }
+
+    CompressTexture(texture);
+
+    return true;
+}
+
+
+void SingleTexelTexture(Texture& texture, RGBColor color)
+{
+    texture.width = 1;
+    texture.height = 1;
+    texture.levels.resize(1);
+    texture.levels[0].width = 1;
+    texture.levels[0].height = 1;
+    texture.levels[0].px.assign(1, color);
+    BuildCoverageMask(texture);
+    StoreInBlocks(texture.levels[0]);
+    CompressTexture(texture);
+}
+
+
+void StartTextureStreaming()
+{
+    for (int i = 0; i < textureStreamingThreads; i++)
+        textureStreamer.threads.emplace_back(StreamTextures);
+}
+
+
+void StopTextureStreaming()
+{
+    {
+        lock_guard<mutex> guard(textureStreamer.lock);
+        textureStreamer.stopping = true;
+    }
+
+    textureStreamer.wake.notify_all();
+
+    // Decodes already started are finished before their threads return, so nothing is still running once they're joined
+    for (int i = 0; i < textureStreamer.threads.size(); i++)
+        textureStreamer.threads[i].join();
+
+    textureStreamer.threads.clear();
+    textureStreamer.waiting.clear();
+    textureStreamer.finished.clear();
+
+    for (int t = 0; t < loadedTextures.size(); t++)
+        loadedTextures[t].loading = false;
+}
+
+
+void StreamTextures()
+{
+    while (true)
+    {
+        TextureRequest request;
+
+        {
+            unique_lock<mutex> guard(textureStreamer.lock);
+            textureStreamer.wake.wait(guard, [] { return textureStreamer.stopping || !textureStreamer.waiting.empty(); });
+
+            if (textureStreamer.stopping)
+                return;
+
+            request = move(textureStreamer.waiting.front());
+            textureStreamer.waiting.pop_front();
+        }
+
+        // Only the request is touched here, the main thread puts it in place between frames
+        DecodeTexture(request.path, request.decoded, request.levelCount);
+
+        {
+            lock_guard<mutex> guard(textureStreamer.lock);
+            textureStreamer.finished.emplace_back(move(request));
+        }
+
+        // The main loop sleeps while nothing changes, so it's woken to draw the texture
+        glfwPostEmptyEvent();
+    }
+}
+
+
+void RequestTexture(int t)
+{
+    Texture& texture = loadedTextures[t];
+    texture.loading = true;
+
+    TextureRequest request;
+    request.texture = t;
+    request.path = texture.path;
+
+    // Only the evicted levels are decoded again, taking along the blocks they kept so they aren't encoded again.
+    // The samplers don't read evicted levels, so the blocks can be moved out.
+    if (!texture.placeholder)
+    {
+        request.levelCount = texture.firstResident;
+        request.decoded.levels.resize(texture.firstResident);
+
+        for (int l = 0; l < texture.firstResident; l++)
+            request.decoded.levels[l].compressed = move(texture.levels[l].compressed);
+    }
+
+    {
+        lock_guard<mutex> guard(textureStreamer.lock);
+        textureStreamer.waiting.emplace_back(move(request));
+    }
+
+    textureStreamer.wake.notify_one();
+}
+
+
+void UpdateTextureStreaming()
+{
+    vector<TextureRequest> finished;
+
+    {
+        lock_guard<mutex> guard(textureStreamer.lock);
+        finished.swap(textureStreamer.finished);
+    }
+
+    bool changed = !finished.empty();
+
+    for (int r = 0; r < finished.size(); r++)
+    {
+        Texture& texture = loadedTextures[finished[r].texture];
+        Texture& decoded = finished[r].decoded;
+
+        texture.loading = false;
+
+        // Files that can't be read stay as they are
+        if (decoded.levels.empty())
+            continue;
+
+        if (texture.placeholder)
+        {
+            texture.width = decoded.width;
+            texture.height = decoded.height;
+            texture.levels = move(decoded.levels);
+            texture.coverage = move(decoded.coverage);
+            texture.coverageStride = decoded.coverageStride;
+            texture.compressedQuality = decoded.compressedQuality;
+            texture.compressTime = decoded.compressTime;
+            texture.placeholder = false;
+        }
+        else
+        {
+            // Only the evicted levels are replaced, the rest are the same as before
+            for (int l = 0; l < texture.firstResident; l++)
+                texture.levels[l] = move(decoded.levels[l]);
+        }
+
+        // Levels that just arrived count as sampled, so they aren't evicted before they're drawn
+        for (int l = 0; l < texture.levels.size(); l++)
+            texture.levels[l].lastSampled = max(texture.levels[l].lastSampled, frameNumber);
+
+        texture.firstResident = 0;
+    }
+
+    size_t used = 0;
+
+    // Evicted levels only hold the blocks kept for decoding them again
+    for (int t = 0; t < loadedTextures.size(); t++)
+        if (loadedTextures[t].streamed)
+            for (int l = loadedTextures[t].firstResident; l < loadedTextures[t].levels.size(); l++)
+                used += LevelMemory(loadedTextures[t].levels[l]);
+
+    // Levels are evicted finest first, since the coarser ones are smaller and sampled as the finer ones go away.
+    // The smallest level always stays, and levels sampled in the last frame are kept even over the budget.
+    while (used > streamingBudget)
+    {
+        int oldest = -1;
+
+        for (int t = 0; t < loadedTextures.size(); t++)
+        {
+            const Texture& texture = loadedTextures[t];
+
+            // Levels being decoded are left alone, so the ones that arrive are still the ones evicted
+            if (!texture.streamed || texture.placeholder || texture.loading || texture.firstResident >= int(texture.levels.size()) - 1)
+                continue;
+
+            int sampled = texture.levels[texture.firstResident].lastSampled;
+
+            if (sampled < frameNumber && (oldest < 0 || sampled < loadedTextures[oldest].levels[loadedTextures[oldest].firstResident].lastSampled))
+                oldest = t;
+        }
+
+        if (oldest < 0)
+            break;
+
+        // Without BC1 sampling the blocks are kept, since they aren't counted and encoding them again is the slow part of decoding
+        TextureLevel& level = loadedTextures[oldest].levels[loadedTextures[oldest].firstResident];
+        used -= LevelMemory(level);
+        vector<RGBColor>().swap(level.px);
+
+        if (compressedTextures)
+            vector<uint64_t>().swap(level.compressed);
+
+        loadedTextures[oldest].firstResident++;
+        changed = true;
+    }
+
+    // Evicted levels the samplers wanted in the last frame are decoded again
+    for (int t = 0; t < loadedTextures.size(); t++)
+    {
+        const Texture& texture = loadedTextures[t];
+
+        if (!texture.streamed || texture.loading)
+            continue;
+
+        for (int l = 0; l < texture.firstResident; l++)
+        {
+            if (texture.levels[l].lastSampled == frameNumber)
+            {
+                RequestTexture(t);
+                break;
+            }
+        }
+    }
+
+    if (!changed)
+        return;
+
+    // The texels moved, so the binding and the decoded blocks are out of date
+    boundTexture.texture = nullptr;
+
+    for (int b = 0; b < blockCacheSize; b++)
+        blockCache[b].block = nullptr;
+
+    framesToDraw = max(framesToDraw, 1);
+}
+
+
+size_t LevelMemory(const TextureLevel& level)
+{
+    // Both formats are kept so they can be switched between, but only the one sampled counts against the budget
+    if (compressedTextures)
+        return level.compressed.size() * sizeof(uint64_t);
+
+    return level.px.size() * sizeof(RGBColor);
+}
+
+
+void PrintTextureStats()
+{
+    cout << (compressedTextures ? "BC1 textures" : "Uncompressed textures") << ", frames took " << averageRenderTime << " ms to draw before switching\n";
+
+    for (int t = 0; t < loadedTextures.size(); t++)
+    {
+        const Texture& texture = loadedTextures[t];
+        size_t uncompressed = 0;
+        size_t compressed = 0;
+
+        for (int l = 0; l < texture.levels.size(); l++)
+        {
+            uncompressed += texture.levels[l].px.size() * sizeof(RGBColor);
+            compressed += texture.levels[l].compressed.size() * sizeof(uint64_t);
+        }
+
+        cout << "    " << (texture.path.empty() ? "(generated)" : texture.path) << ": " << texture.width << "x" << texture.height
+             << ", " << uncompressed / 1024 << " KB uncompressed, " << compressed / 1024 << " KB in BC1, "
+             << texture.compressedQuality << " dB PSNR, encoded in " << texture.compressTime << " ms\n";
+    }
+}
+
+
+void BindTexture(const Texture* texture)
+{
+    boundTexture.texture = texture;
+    boundTexture.coverage = texture->coverage.data();
+    boundTexture.coverageStride = texture->coverageStride;
+    boundTexture.wrapMode = (wrapOverride == WRAP_MODE_COUNT || texture->atlas) ? texture->wrapMode : wrapOverride;
+    boundTexture.levelCount = int(texture->levels.size());
+    boundTexture.firstLevel = texture->firstResident;
+
+    for (int l = 0; l < boundTexture.levelCount; l++)
+    {
+        const TextureLevel& level = texture->levels[l];
+        LevelBinding& binding = boundTexture.levels[l];
+
+        binding.px = level.px.data();
+        binding.compressed = level.compressed.data();
+        binding.lastSampled = &level.lastSampled;
+        binding.blocksX = level.blocksX;
+        binding.width = level.width;
+        binding.height = level.height;
+        binding.scaleU = float(level.width);
+        binding.scaleV = float(level.height);
+    }
+}
+
+
+void BuildCoverageMask(Texture& texture)
+{
+    int width = texture.width;
+    int height = texture.height;
+    vector<RGBColor>& px = texture.levels[0].px;
+
+    texture.coverageStride = (width + 63) >> 6;
+    texture.coverage.assign(size_t(texture.coverageStride) * height, 0);
+
+    // Magenta is used as the transparent color
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            RGBColor texel = px[x + (y * width)];
+
+            if (!(texel.r == 255 && texel.g == 0 && texel.b == 255))
+                texture.coverage[(y * texture.coverageStride) + (x >> 6)] |= uint64_t(1) << (x & 63);
+        }
+    }
+
+    // Filtering only reaches one texel away from a solid texel, so one ring of see-through texels is filled in
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            if ((texture.coverage[(y * texture.coverageStride) + (x >> 6)] >> (x & 63)) & 1)
+                continue;
+
+            int r = 0, g = 0, b = 0, count = 0;
+
+            for (int ny = max(y - 1, 0); ny <= min(y + 1, height - 1); ny++)
+            {
+                for (int nx = max(x - 1, 0); nx <= min(x + 1, width - 1); nx++)
+                {
+                    if (!((texture.coverage[(ny * texture.coverageStride) + (nx >> 6)] >> (nx & 63)) & 1))
+                        continue;
+
+                    RGBColor neighbour = px[nx + (ny * width)];
+                    r += neighbour.r;
+                    g += neighbour.g;
+                    b += neighbour.b;
+                    count++;
+                }
+            }
+
+            if (count > 0)
+                px[x + (y * width)] = { uint8_t(r / count), uint8_t(g / count), uint8_t(b / count) };
+        }
+    }
+}
+
+
+void BuildMipLevels(Texture& texture, int levelCount)
+{
+    // Which texels of the level above are solid, so see-through colors don't bleed into the smaller levels
+    vector<uint8_t> solid(size_t(texture.width) * texture.height);
+
+    for (int y = 0; y < texture.height; y++)
+        for (int x = 0; x < texture.width; x++)
+            solid[x + (y * texture.width)] = (texture.coverage[(y * texture.coverageStride) + (x >> 6)] >> (x & 63)) & 1;
+
+    while (texture.levels.size() < levelCount && (texture.levels.back().width > 1 || texture.levels.back().height > 1))
+    {
+        const TextureLevel& above = texture.levels.back();
+
+        TextureLevel level;
+        level.width = max(above.width / 2, 1);
+        level.height = max(above.height / 2, 1);
+        level.px.resize(size_t(level.width) * level.height);
+
+        vector<uint8_t> levelSolid(level.px.size());
+
+        // Each texel averages the 2x2 texels above it, only the solid ones if there are any
+        for (int y = 0; y < level.height; y++)
+        {
+            for (int x = 0; x < level.width; x++)
+            {
+                int x0 = min(x * 2, above.width - 1);
+                int x1 = min(x * 2 + 1, above.width - 1);
+                int y0 = min(y * 2, above.height - 1);
+                int y1 = min(y * 2 + 1, above.height - 1);
+                int children[4] = { x0 + (y0 * above.width), x1 + (y0 * above.width), x0 + (y1 * above.width), x1 + (y1 * above.width) };
+
+                int solidCount = solid[children[0]] + solid[children[1]] + solid[children[2]] + solid[children[3]];
+                int r = 0, g = 0, b = 0, count = 0;
+
+                for (int c = 0; c < 4; c++)
+                {
+                    if (solidCount > 0 && !solid[children[c]])
+                        continue;
+
+                    r += above.px[children[c]].r;
+                    g += above.px[children[c]].g;
+                    b += above.px[children[c]].b;
+                    count++;
+                }
+
+                level.px[x + (y * level.width)] = { uint8_t((r + count / 2) / count), uint8_t((g + count / 2) / count), uint8_t((b + count / 2) / count) };
+                levelSolid[x + (y * level.width)] = solidCount > 0;
+            }
+        }
+
+        texture.levels.emplace_back(move(level));
+        solid.swap(levelSolid);
+    }
+}
+
+
+void BuildAtlas(vector<Mesh>& meshes)
+{
+    // A texture can only go in the atlas if it's small, and no mesh using it goes further outside 0 to 1 than its gutter,
+    // since it can't repeat in there
+    vector<uint8_t> packable(loadedTextures.size(), 1);
+
+    for (int i = 0; i < meshes.size(); i++)
+    {
+        const Mesh& mesh = meshes[i];
+        const Texture& texture = loadedTextures[mesh.texture];
+
+        if (texture.streamed || texture.width > atlasMaxTextureSize || texture.height > atlasMaxTextureSize)
+            packable[mesh.texture] = 0;
+
+        float marginU = float(atlasGutter) / texture.width;
+        float marginV = float(atlasGutter) / texture.height;
+
+        for (int j = 0; j < mesh.tris.size(); j++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                UV uv = mesh.tris[j].p[k].uv;
+
+                if (uv.u < -marginU || uv.u > 1 + marginU || uv.v < -marginV || uv.v > 1 + marginV)
+                    packable[mesh.texture] = 0;
+            }
+        }
+    }
+
+    // Where each texture goes, with its gutter. Sizes and positions are multiples of the gutter,
+    // so the 2x2 averages of the mip levels the atlas keeps never mix two textures.
+    struct AtlasRect
+    {
+        int texture = 0;
+        int x = -1;
+        int y = -1;
+        int width = 0;
+        int height = 0;
+    };
+
+    vector<AtlasRect> rects;
+    vector<int> rectOfTexture(loadedTextures.size(), -1);
+    int area = 0;
+    int widest = 0;
+
+    for (int i = 0; i < meshes.size(); i++)
+    {
+        int t = meshes[i].texture;
+
+        if (!packable[t] || rectOfTexture[t] >= 0)
+            continue;
+
+        AtlasRect rect;
+        rect.texture = t;
+        rect.width = ((loadedTextures[t].width + atlasGutter - 1) / atlasGutter + 2) * atlasGutter;
+        rect.height = ((loadedTextures[t].height + atlasGutter - 1) / atlasGutter + 2) * atlasGutter;
+
+        area += rect.width * rect.height;
+        widest = max(widest, rect.width);
+        rectOfTexture[t] = 0;
+        rects.emplace_back(rect);
+    }
+
+    // One texture is already drawn with one binding
+    if (rects.size() < 2)
+        return;
+
+    // Shelves of the tallest textures first, in a square power of two width big enough for all of them
+    sort(rects.begin(), rects.end(), [](const AtlasRect& l, const AtlasRect& r) { return l.height > r.height; });
+
+    int atlasWidth = atlasGutter;
+
+    while (atlasWidth < atlasMaxSize && (atlasWidth < widest || atlasWidth * atlasWidth < area))
+        atlasWidth *= 2;
+
+    int shelfX = 0;
+    int shelfY = 0;
+    int shelfHeight = 0;
+    int placed = 0;
+
+    for (int r = 0; r < rects.size(); r++)
+    {
+        if (shelfX + rects[r].width > atlasWidth)
+        {
+            shelfX = 0;
+            shelfY += shelfHeight;
+            shelfHeight = 0;
+        }
+
+        // Textures that don't fit keep their own binding
+        if (shelfY + rects[r].height > atlasMaxSize)
+            continue;
+
+        rects[r].x = shelfX;
+        rects[r].y = shelfY;
+        shelfX += rects[r].width;
+        shelfHeight = max(shelfHeight, rects[r].height);
+        placed++;
+    }
+
+    if (placed < 2)
+        return;
+
+    Texture atlas;
+    atlas.atlas = true;
+    atlas.width = atlasWidth;
+    atlas.height = shelfY + shelfHeight;
+    atlas.levels.resize(1);
+    atlas.levels[0].width = atlas.width;
+    atlas.levels[0].height = atlas.height;
+    atlas.levels[0].px.resize(size_t(atlas.width) * atlas.height);
+    atlas.coverageStride = (atlas.width + 63) >> 6;
+    atlas.coverage.assign(size_t(atlas.coverageStride) * atlas.height, 0);
+
+    // The gutter repeats the edge texels, so bilinear taps and mip averages past an edge see what clamping would
+    for (int r = 0; r < rects.size(); r++)
+    {
+        const AtlasRect& rect = rects[r];
+
+        if (rect.x < 0)
+        {
+            rectOfTexture[rect.texture] = -1;
+            continue;
+        }
+
+        rectOfTexture[rect.texture] = r;
+
+        const Texture& source = loadedTextures[rect.texture];
+        LevelBinding sourceLevel;
+        sourceLevel.blocksX = source.levels[0].blocksX;
+
+        for (int y = 0; y < rect.height; y++)
+        {
+            for (int x = 0; x < rect.width; x++)
+            {
+                int sourceX = min(max(x - atlasGutter, 0), source.width - 1);
+                int sourceY = min(max(y - atlasGutter, 0), source.height - 1);
+                int atlasX = rect.x + x;
+                int atlasY = rect.y + y;
+
+                atlas.levels[0].px[atlasX + (atlasY * atlas.width)] = source.levels[0].px[TexelAddress(sourceLevel, sourceX, sourceY)];
+
+                if ((source.coverage[(sourceY * source.coverageStride) + (sourceX >> 6)] >> (sourceX & 63)) & 1)
+                    atlas.coverage[(atlasY * atlas.coverageStride) + (atlasX >> 6)] |= uint64_t(1) << (atlasX & 63);
+            }
+        }
+    }
+
+    BuildMipLevels(atlas);
+
+    // Smaller levels would blend textures across their gutters
+    if (atlas.levels.size() > atlasMipLevels)
+        atlas.levels.resize(atlasMipLevels);
+
+    for (int l = 0; l < atlas.levels.size(); l++)
+        StoreInBlocks(atlas.levels[l]);
+
+    CompressTexture(atlas);
+
+    loadedTextures.emplace_back(move(atlas));
+
+    // Move the texture coordinates of each packed mesh onto its texture's place in the atlas, and join the meshes together
+    Mesh merged;
+    merged.texture = int(loadedTextures.size()) - 1;
+    vector<Mesh> unpacked;
+
+    for (int i = 0; i < meshes.size(); i++)
+    {
+        int r = rectOfTexture[meshes[i].texture];
+
+        if (r < 0)
+        {
+            unpacked.emplace_back(move(meshes[i]));
+            continue;
+        }
+
+        const Texture& source = loadedTextures[rects[r].texture];
+        const Texture& packed = loadedTextures[merged.texture];
+        float offsetU = float(rects[r].x + atlasGutter) / packed.width;
+        float offsetV = float(rects[r].y + atlasGutter) / packed.height;
+        float scaleU = float(source.width) / packed.width;
+        float scaleV = float(source.height) / packed.height;
+
+        for (int j = 0; j < meshes[i].tris.size(); j++)
+        {
+            Triangle tri = meshes[i].tris[j];
+
+            for (int k = 0; k < 3; k++)
+            {
+                tri.p[k].uv.u = offsetU + (tri.p[k].uv.u * scaleU);
+                tri.p[k].uv.v = offsetV + (tri.p[k].uv.v * scaleV);
+            }
+
+            merged.tris.emplace_back(tri);
+        }
+    }
+
+    // The merged mesh takes the place of the meshes it replaced, ahead of the ones left out
+    meshes.clear();
+    meshes.emplace_back(move(merged));
+
+    for (int i = 0; i < unpacked.size(); i++)
+        meshes.emplace_back(move(unpacked[i]));
+}
+
+
+void StoreInBlocks(TextureLevel& level)
+{
+    int blockSize = 1 << texelBlockShift;
+
+    // Partial blocks at the right and top edges are padded out
+    level.blocksX = (level.width + blockSize - 1) >> texelBlockShift;
+    int blocksY = (level.height + blockSize - 1) >> texelBlockShift;
+
+    vector<RGBColor> blocks(size_t(level.blocksX) * blocksY << (texelBlockShift * 2));
+
+    LevelBinding binding;
+    binding.blocksX = level.blocksX;
+
+    for (int y = 0; y < level.height; y++)
+        for (int x = 0; x < level.width; x++)
+            blocks[TexelAddress(binding, x, y)] = level.px[x + (y * level.width)];
+
+    level.px.swap(blocks);
+}
+
+
+void CompressTexture(Texture& texture)
+{
+    static_assert(texelBlockShift == 2, "BC1 blocks are 4x4 texels");
+
+    auto start = std::chrono::high_resolution_clock::now();
+    bool measured = false;
+    double squaredError = 0;
+
+    for (int l = 0; l < texture.levels.size(); l++)
+    {
+        TextureLevel& level = texture.levels[l];
+        int blocksY = (level.height + 3) >> 2;
+
+        if (!level.compressed.empty())
+            continue;
+
+        measured |= l == 0;
+        level.compressed.resize(size_t(level.blocksX) * blocksY);
+
+        for (int b = 0; b < level.compressed.size(); b++)
+        {
+            int blockX = (b % level.blocksX) << 2;
+            int blockY = (b / level.blocksX) << 2;
+
+            // Texels past the right and top edges are padding, so they aren't fitted
+            int valid = 0;
+
+            for (int i = 0; i < 16; i++)
+                if (blockX + (i & 3) < level.width && blockY + (i >> 2) < level.height)
+                    valid |= 1 << i;
+
+            const RGBColor* texels = &level.px[size_t(b) << 4];
+            level.compressed[b] = EncodeBlock(texels, valid);
+
+            if (l > 0)
+                continue;
+
+            RGBColor decoded[16];
+            DecodeBlock(level.compressed[b], decoded);
+
+            for (int i = 0; i < 16; i++)
+            {
+                if (!((valid >> i) & 1))
+                    continue;
+
+                int r = decoded[i].r - texels[i].r;
+                int g = decoded[i].g - texels[i].g;
+                int bl = decoded[i].b - texels[i].b;
+                squaredError += (r * r) + (g * g) + (bl * bl);
+            }
+        }
+    }
+
+    // The quality and time are only known when the full size image was encoded, not when its blocks were kept
+    if (!measured)
+        return;
+
+    // An exact match is given a high finite value
+    double meanError = squaredError / (double(texture.width) * texture.height * 3);
+    texture.compressedQuality = float(10 * log10((255.0 * 255.0) / max(meanError, 0.0001)));
+    texture.compressTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+
+uint64_t EncodeBlock(const RGBColor* texels, int valid)
+{
+    float mean[3] = { 0, 0, 0 };
+    int count = 0;
+
+    for (int i = 0; i < 16; i++)
+    {
+        if (!((valid >> i) & 1))
+            continue;
+
+        mean[0] += texels[i].r;
+        mean[1] += texels[i].g;
+        mean[2] += texels[i].b;
+        count++;
+    }
+
+    if (count == 0)
+        return 0;
+
+    for (int c = 0; c < 3; c++)
+        mean[c] /= count;
+
+    // The end colors lie on the line the colors spread out along most, found from their covariance by power iteration
+    float covariance[6] = { 0, 0, 0, 0, 0, 0 }; // rr, rg, rb, gg, gb, bb
+
+    for (int i = 0; i < 16; i++)
+    {
+        if (!((valid >> i) & 1))
+            continue;
+
+        float r = texels[i].r - mean[0];
+        float g = texels[i].g - mean[1];
+        float b = texels[i].b - mean[2];
+
+        covariance[0] += r * r;
+        covariance[1] += r * g;
+        covariance[2] += r * b;
+        covariance[3] += g * g;
+        covariance[4] += g * b;
+        covariance[5] += b * b;
+    }
+
+    float axis[3] = { 1, 1, 1 };
+
+    for (int n = 0; n < 4; n++)
+    {
+        float r = (axis[0] * covariance[0]) + (axis[1] * covariance[1]) + (axis[2] * covariance[2]);
+        float g = (axis[0] * covariance[1]) + (axis[1] * covariance[3]) + (axis[2] * covariance[4]);
+        float b = (axis[0] * covariance[2]) + (axis[1] * covariance[4]) + (axis[2] * covariance[5]);
+        float largest = max(max(fabsf(r), fabsf(g)), fabsf(b));
+
+        // All the colors are the same
+        if (largest < 0.0001f)
+            break;
+
+        axis[0] = r / largest;
+        axis[1] = g / largest;
+        axis[2] = b / largest;
+    }
+
+    // Start from the colors furthest along the line each way
+    int lowest = -1;
+    int highest = -1;
+    float lowestAlong = 0;
+    float highestAlong = 0;
+
+    for (int i = 0; i < 16; i++)
+    {
+        if (!((valid >> i) & 1))
+            continue;
+
+        float along = (texels[i].r * axis[0]) + (texels[i].g * axis[1]) + (texels[i].b * axis[2]);
+
+        if (lowest < 0 || along < lowestAlong)
+        {
+            lowest = i;
+            lowestAlong = along;
+        }
+
+        if (highest < 0 || along > highestAlong)
+        {
+            highest = i;
+            highestAlong = along;
+        }
+    }
+
+    int error;
+    uint64_t block = FitBlockIndices(texels, valid, To565(texels[highest].r, texels[highest].g, texels[highest].b),
+        To565(texels[lowest].r, texels[lowest].g, texels[lowest].b), error);
+
+    // Then move the end colors to where they best fit the colors that picked them, by least squares
+    for (int pass = 0; pass < 2 && error > 0; pass++)
+    {
+        float weights[4] = { 1, 0, 2.0f / 3, 1.0f / 3 }; // Amount of the first end color in each palette color
+        float aa = 0, ab = 0, bb = 0;
+        float ax[3] = { 0, 0, 0 };
+        float bx[3] = { 0, 0, 0 };
+
+        for (int i = 0; i < 16; i++)
+        {
+            if (!((valid >> i) & 1))
+                continue;
+
+            float a = weights[(block >> (32 + (i * 2))) & 3];
+            float color[3] = { float(texels[i].r), float(texels[i].g), float(texels[i].b) };
+
+            aa += a * a;
+            ab += a * (1 - a);
+            bb += (1 - a) * (1 - a);
+
+            for (int c = 0; c < 3; c++)
+            {
+                ax[c] += a * color[c];
+                bx[c] += (1 - a) * color[c];
+            }
+        }
+
+        float determinant = (aa * bb) - (ab * ab);
+
+        // Every color picked the same end
+        if (fabsf(determinant) < 0.0001f)
+            break;
+
+        float first[3], second[3];
+
+        for (int c = 0; c < 3; c++)
+        {
+            first[c] = min(max(((ax[c] * bb) - (bx[c] * ab)) / determinant, 0.0f), 255.0f);
+            second[c] = min(max(((bx[c] * aa) - (ax[c] * ab)) / determinant, 0.0f), 255.0f);
+        }
+
+        int refinedError;
+        uint64_t refined = FitBlockIndices(texels, valid, To565(first[0], first[1], first[2]), To565(second[0], second[1], second[2]), refinedError);
+
+        if (refinedError >= error)
+            break;
+
+        block = refined;
+        error = refinedError;
+    }
+
+    return block;
+}
+
+
+uint64_t FitBlockIndices(const RGBColor* texels, int valid, uint16_t color0, uint16_t color1, int& error)
+{
+    // The first end color is kept the larger, so the block decodes with four colors
+    if (color0 < color1)
+        swap(color0, color1);
+
+    RGBColor palette[4];
+    BlockPalette(color0, color1, palette);
+
+    // With equal ends only the first two colors are the same, and index 0 picks it
+    int choices = color0 == color1 ? 1 : 4;
+    uint64_t indices = 0;
+    error = 0;
+
+    for (int i = 0; i < 16; i++)
+    {
+        if (!((valid >> i) & 1))
+            continue;
+
+        int best = 0;
+        int bestDistance = INT32_MAX;
+
+        for (int p = 0; p < choices; p++)
+        {
+            int r = palette[p].r - texels[i].r;
+            int g = palette[p].g - texels[i].g;
+            int b = palette[p].b - texels[i].b;
+            int distance = (r * r) + (g * g) + (b * b);
+
+            if (distance < bestDistance)
+            {
+                best = p;
+                bestDistance = distance;
+            }
+        }
+
+        indices |= uint64_t(best) << (i * 2);
+        error += bestDistance;
+    }
+
+    return color0 | (uint64_t(color1) << 16) | (indices << 32);
+}
+
+
+void DecodeBlock(uint64_t block, RGBColor* texels)
+{
+    RGBColor palette[4];
+    BlockPalette(uint16_t(block), uint16_t(block >> 16), palette);
+
+    uint32_t indices = uint32_t(block >> 32);
+
+    for (int i = 0; i < 16; i++)
+        texels[i] = palette[(indices >> (i * 2)) & 3];
+}
+
+
+void BlockPalette(uint16_t color0, uint16_t color1, RGBColor* palette)
+{
+    RGBColor first = From565(color0);
+    RGBColor second = From565(color1);
+
+    palette[0] = first;
+    palette[1] = second;
+
+    // Blocks with the first end color larger have two colors between the ends, otherwise one and black
+    if (color0 > color1)
+    {
+        palette[2] = { uint8_t(((2 * first.r) + second.r + 1) / 3), uint8_t(((2 * first.g) + second.g + 1) / 3), uint8_t(((2 * first.b) + second.b + 1) / 3) };
+        palette[3] = { uint8_t((first.r + (2 * second.r) + 1) / 3), uint8_t((first.g + (2 * second.g) + 1) / 3), uint8_t((first.b + (2 * second.b) + 1) / 3) };
+    }
+    else
+    {
+        palette[2] = { uint8_t((first.r + second.r) / 2), uint8_t((first.g + second.g) / 2), uint8_t((first.b + second.b) / 2) };
+        palette[3] = { 0, 0, 0 };
+    }
+}
+
+
+inline uint16_t To565(float r, float g, float b)
+{
+    int r5 = int(r * (31.0f / 255) + 0.5f);
+    int g6 = int(g * (63.0f / 255) + 0.5f);
+    int b5 = int(b * (31.0f / 255) + 0.5f);
+
+    return uint16_t((r5 << 11) | (g6 << 5) | b5);
+}
+
+
+inline RGBColor From565(uint16_t color)
+{
+    // The top bits are repeated in the low bits, so full white stays 255
+    int r5 = (color >> 11) & 31;
+    int g6 = (color >> 5) & 63;
+    int b5 = color & 31;
+
+    return { uint8_t((r5 << 3) | (r5 >> 2)), uint8_t((g6 << 2) | (g6 >> 4)), uint8_t((b5 << 3) | (b5 >> 2)) };
+}
+
+
+inline int TexelAddress(const LevelBinding& level, int x, int y)
+{
+    int blockMask = (1 << texelBlockShift) - 1;
+    int block = ((y >> texelBlockShift) * level.blocksX) + (x >> texelBlockShift);
+
+    return (block << (texelBlockShift * 2)) + ((y & blockMask) << texelBlockShift) + (x & blockMask);
+}
+
+
+template <bool compressed>
+inline RGBColor FetchTexel(const LevelBinding& level, int x, int y)
+{
+    int address = TexelAddress(level, x, y);
+
+    if (!compressed)
+        return level.px[address];
+
+    // Each compressed block holds the 16 texels of one 4x4 block, so it's found from the address without its lowest 4 bits
+    const uint64_t* block = level.compressed + (address >> 4);
+    DecodedBlock& cached = blockCache[(uintptr_t(block) >> 3) & (blockCacheSize - 1)];
+
+    // Only the palette is decoded, so a block that's only sampled once costs little more than one that's sampled often
+    if (cached.block != block)
+    {
+        BlockPalette(uint16_t(*block), uint16_t(*block >> 16), cached.palette);
+        cached.indices = uint32_t(*block >> 32);
+        cached.block = block;
+    }
+
+    return cached.palette[(cached.indices >> ((address & 15) * 2)) & 3];
+}
+
+
+inline int FloorToInt(float x)
+{
+    int truncated = int(x);
+    return truncated - (x < float(truncated));
+}
+
+
+template <int wrapMode>
+inline int WrapTexel(int x, int size)
+{
+    // Power of two sizes wrap with a mask, which also works for negative coordinates
+    bool powerOfTwo = (size & (size - 1)) == 0;
+
+    if (wrapMode == WRAP_REPEAT)
+    {
+        if (powerOfTwo)
+            return x & (size - 1);
+
+        x %= size;
+        return x < 0 ? x + size : x;
+    }
+
+    if (wrapMode == WRAP_MIRROR)
+    {
+        // Every other copy has the size bit set, and flipping all the bits of those counts them down from the far edge
+        if (powerOfTwo)
+            return (x ^ -int((x & size) != 0)) & (size - 1);
+
+        int period = size * 2;
+        x %= period;
+
+        if (x < 0)
+            x += period;
+
+        return x < size ? x : period - 1 - x;
+    }
+
+    return min(max(x, 0), size - 1);
+}
+
+
+bool TexelCovered(float u, float v)
+{
+    const LevelBinding& level = boundTexture.levels[0];
+
+    int x = FloorToInt(u * level.scaleU);
+    int y = FloorToInt(v * level.scaleV);
+
+    if (boundTexture.wrapMode == WRAP_REPEAT)
+    {
+        x = WrapTexel<WRAP_REPEAT>(x, level.width);
+        y = WrapTexel<WRAP_REPEAT>(y, level.height);
+    }
+    else if (boundTexture.wrapMode == WRAP_MIRROR)
+    {
+        x = WrapTexel<WRAP_MIRROR>(x, level.width);
+        y = WrapTexel<WRAP_MIRROR>(y, level.height);
+    }
+    else
+    {
+        x = WrapTexel<WRAP_CLAMP>(x, level.width);
+        y = WrapTexel<WRAP_CLAMP>(y, level.height);
+    }
+
+    return (boundTexture.coverage[(y * boundTexture.coverageStride) + (x >> 6)] >> (x & 63)) & 1;
+}
+
+
+template <int wrapMode, bool compressed>
+RGBColor SampleNearest(float u, float v, int level)
+{
+    const LevelBinding& binding = boundTexture.levels[level];
+
+    int x = WrapTexel<wrapMode>(FloorToInt(u * binding.scaleU), binding.width);
+    int y = WrapTexel<wrapMode>(FloorToInt(v * binding.scaleV), binding.height);
+
+    return FetchTexel<compressed>(binding, x, y);
+}
+
+
+template <int wrapMode, bool compressed>
+RGBColor SampleFiltered(float u, float v, int level)
+{
+    const LevelBinding& binding = boundTexture.levels[level];
+
+    return Filter<wrapMode, compressed>(u * binding.scaleU, v * binding.scaleV, level);
+}
+
+
+template <int wrapMode, bool compressed>
+inline RGBColor SampleLevels(float u, float v, float lod, bool filtered)
+{
+    int last = boundTexture.levelCount - 1;
+    int first = boundTexture.firstLevel;
+
+    // Magnified textures, and textures without levels, use the full size image.
+    // Evicted levels are noted as wanted, and sampled from the finest level still in memory.
+    if (mipMode == MIP_NONE || lod <= 0 || last == 0)
+    {
+        *boundTexture.levels[0].lastSampled = frameNumber;
+        return filtered ? SampleFiltered<wrapMode, compressed>(u, v, first) : SampleNearest<wrapMode, compressed>(u, v, first);
+    }
+
+    if (mipMode == MIP_NEAREST)
+    {
+        int level = min(int(lod + 0.5f), last);
+        *boundTexture.levels[level].lastSampled = frameNumber;
+        level = max(level, first);
+        return filtered ? SampleFiltered<wrapMode, compressed>(u, v, level) : SampleNearest<wrapMode, compressed>(u, v, level);
+    }
+
+    int level = int(lod);
+
+    if (level >= last)
+    {
+        *boundTexture.levels[last].lastSampled = frameNumber;
+        return filtered ? SampleFiltered<wrapMode, compressed>(u, v, last) : SampleNearest<wrapMode, compressed>(u, v, last);
+    }
+
+    // Both levels blended are wanted, or the coarser one could be evicted while it's still in use
+    *boundTexture.levels[level].lastSampled = frameNumber;
+    *boundTexture.levels[level + 1].lastSampled = frameNumber;
+
+    int nearLevel = max(level, first);
+    int farLevel = max(level + 1, first);
+    RGBColor near = filtered ? SampleFiltered<wrapMode, compressed>(u, v, nearLevel) : SampleNearest<wrapMode, compressed>(u, v, nearLevel);
+    RGBColor far = filtered ? SampleFiltered<wrapMode, compressed>(u, v, farLevel) : SampleNearest<wrapMode, compressed>(u, v, farLevel);
+    float t = lod - level;
+
+    return { uint8_t(near.r + (far.r - near.r) * t), uint8_t(near.g + (far.g - near.g) * t), uint8_t(near.b + (far.b - near.b) * t) };
+}
+
+
+inline RGBColor SampleTexture(float u, float v, float lod, bool filtered)
+{
+    if (compressedTextures)
+    {
+        if (boundTexture.wrapMode == WRAP_REPEAT)
+            return SampleLevels<WRAP_REPEAT, true>(u, v, lod, filtered);
+        if (boundTexture.wrapMode == WRAP_MIRROR)
+            return SampleLevels<WRAP_MIRROR, true>(u, v, lod, filtered);
+
+        return SampleLevels<WRAP_CLAMP, true>(u, v, lod, filtered);
+    }
+
+    if (boundTexture.wrapMode == WRAP_REPEAT)
+        return SampleLevels<WRAP_REPEAT, false>(u, v, lod, filtered);
+    if (boundTexture.wrapMode == WRAP_MIRROR)
+        return SampleLevels<WRAP_MIRROR, false>(u, v, lod, filtered);
+
+    return SampleLevels<WRAP_CLAMP, false>(u, v, lod, filtered);
+}
+
+
+void TextureGradients::Setup(const Triangle& tri, const TriangleSetup& setup)
+{
+    // Barycentric weights change by the edge steps over the doubled area for every pixel moved
+    float scale = float(subPixelScale) * setup.invArea;
+    float width = boundTexture.levels[0].scaleU;
+    float height = boundTexture.levels[0].scaleV;
+
+    uX = uY = vX = vY = zX = zY = 0;
+
+    for (int k = 0; k < 3; k++)
+    {
+        float stepX = float(setup.edgeStepX[k]) * scale;
+        float stepY = float(setup.edgeStepY[k]) * scale;
+
+        uX += tri.p[k].uv.u * setup.invZ[k] * stepX;
+        uY += tri.p[k].uv.u * setup.invZ[k] * stepY;
+        vX += tri.p[k].uv.v * setup.invZ[k] * stepX;
+        vY += tri.p[k].uv.v * setup.invZ[k] * stepY;
+        zX += setup.invZ[k] * stepX;
+        zY += setup.invZ[k] * stepY;
+    }
+
+    uX *= width;
+    uY *= width;
+    vX *= height;
+    vY *= height;
+}
+
+
+inline float TextureGradients::Lod(float u, float v, float depth) const
+{
+    // u is (u/z) / (1/z), so its change across a pixel follows from the quotient rule
+    float invDepth = 1 / depth;
+    float texelU = u * boundTexture.levels[0].scaleU;
+    float texelV = v * boundTexture.levels[0].scaleV;
+
+    float dudx = (uX - texelU * zX) * invDepth;
+    float dvdx = (vX - texelV * zX) * invDepth;
+    float dudy = (uY - texelU * zY) * invDepth;
+    float dvdy = (vY - texelV * zY) * invDepth;
+
+    // The longer of the pixel's two sides in texels, as a power of two
+    float spanSquared = max((dudx * dudx) + (dvdx * dvdx), (dudy * dudy) + (dvdy * dvdy));
+
+    // The exponent bits of a float with the mantissa added on as a straight line are within 0.09 of log2, close enough to pick levels
+    uint32_t bits;
+    memcpy(&bits, &spanSquared, sizeof(bits));
+
+    return 0.5f * ((float(bits) * (1.0f / (1 << 23))) - 127);
+}
+
+
+// Shaders plug materials into the rasterizer. They are template parameters of the triangle kernels,
+// so their functions are inlined into the pixel loops instead of being called through a pointer.
+// Each shader is a template on the pipeline feature mask and provides:
+//     static const int varyingCount; Number of values passed from the points to the pixels
+//     static const int usedFeatures; Pipeline features it reads, others are ignored when compiling it
+//     static const int coverageFeatures; Features that change which pixels it covers
+//     void Vertex(const Triangle& tri, int k, float* varyings); Fill in the varyings of point k
+//     void Setup(const Triangle& tri, const TriangleSetup& setup, const TextureGradients* found); Find what the pixels of a triangle share,
+//         before Fragment. Texture gradients already found for the triangle may be passed in, instead of finding them again
+//     bool Covers(const Triangle& tri, const float* varyings); False where the surface is see-through
+//     bool Fragment(const Triangle& tri, const float* varyings, float depth, RGBColor& color); Find the color, false to discard
+// Varyings are interpolated with perspective correction.
+
+
+// Texture, vertex colors, face lighting and fog, as set by the number keys
+template <int features>
+struct LitShader
+{
+    static const int varyingCount = 5; // u, v, vertex color
+    static const int usedFeatures = PIPE_FLAT | PIPE_FILTER | PIPE_VERTEX_COLOR | PIPE_LIGHTING | PIPE_FOG;
+    static const int coverageFeatures = PIPE_FLAT;
+
+    TextureGradients gradients;
+
+    void Vertex(const Triangle& tri, int k, float* varyings) const
+    {
+        varyings[0] = tri.p[k].uv.u;
+        varyings[1] = tri.p[k].uv.v;
+        varyings[2] = tri.p[k].light.r;
+        varyings[3] = tri.p[k].light.g;
+        varyings[4] = tri.p[k].light.b;
+    }
+
+    void Setup(const Triangle& tri, const TriangleSetup& setup, const TextureGradients* found = nullptr)
+    {
+        if (!(features & PIPE_FLAT) && mipMode != MIP_NONE)
+        {
+            if (found)
+                gradients = *found;
+            else
+                gradients.Setup(tri, setup);
+        }
+    }
+
+    bool Covers(const Triangle& tri, const float* varyings) const
+    {
+        if (features & PIPE_FLAT)
+            return true;
+
+        // Both texture paths only discard when the nearest texel is transparent
+        return TexelCovered(varyings[0], varyings[1]);
+    }
+
+    bool Fragment(const Triangle& tri, const float* varyings, float depth, RGBColor& vertexWeightedCol) const
+    {
+        float colWeightR = varyings[2];
+        float colWeightG = varyings[3];
+        float colWeightB = varyings[4];
+
+        if (features & PIPE_FLAT)
+        {
+            vertexWeightedCol = { 255, 255, 255 };
+        }
+        else
+        {
+            // Discard before any color math
+            if (!TexelCovered(varyings[0], varyings[1]))
+                return false;
+
+            float lod = mipMode != MIP_NONE ? gradients.Lod(varyings[0], varyings[1], depth) : 0;
+            vertexWeightedCol = SampleTexture(varyings[0], varyings[1], lod, features & PIPE_FILTER);
+        }
+        if (features & PIPE_VERTEX_COLOR)
+        {
+            if (vertexWeightedCol.r - colWeightR > 0)
+                vertexWeightedCol.r -= colWeightR;
+            else
+                vertexWeightedCol.r = 0;
+            if (vertexWeightedCol.g - colWeightG > 0)
+                vertexWeightedCol.g -= colWeightG;
+            else
+                vertexWeightedCol.g = 0;
+            if (vertexWeightedCol.b - colWeightB > 0)
+                vertexWeightedCol.b -= colWeightB;
+            else
+                vertexWeightedCol.b = 0;
+        }
+        if (features & PIPE_LIGHTING)
+        {
+            if (vertexWeightedCol.r - tri.lighting > 0)
+                vertexWeightedCol.r -= tri.lighting;
+            else
+                vertexWeightedCol.r = 0;
+            if (vertexWeightedCol.g - tri.lighting > 0)
+                vertexWeightedCol.g -= tri.lighting;
+            else
+                vertexWeightedCol.g = 0;
+            if (vertexWeightedCol.b - tri.lighting > 0)
+                vertexWeightedCol.b -= tri.lighting;
+            else
+                vertexWeightedCol.b = 0;
+        }
+        if (features & PIPE_FOG)
+        {
+            if (1 / depth > 20)
+            {
+                if (vertexWeightedCol.r - ((1 / depth) - 20) * fogDepth > 0)
+                    vertexWeightedCol.r -= ((1 / depth) - 20) * fogDepth;
+                else
+                    vertexWeightedCol.r = 0;
+                if (vertexWeightedCol.g - ((1 / depth) - 20) * fogDepth > 0)
+                    vertexWeightedCol.g -= ((1 / depth) - 20) * fogDepth;
+                else
+                    vertexWeightedCol.g = 0;
+                if (vertexWeightedCol.b - ((1 / depth) - 20) * fogDepth > 0)
+                    vertexWeightedCol.b -= ((1 / depth) - 20) * fogDepth;
+                else
+                    vertexWeightedCol.b = 0;
+            }
+        }
+
+        return true;
+    }
+};
+
+
+// Texture only, no lighting or fog
+template <int features>
+struct UnlitShader
+{
+    static const int varyingCount = 2; // u, v
+    static const int usedFeatures = PIPE_FILTER;
+    static const int coverageFeatures = 0;
+
+    TextureGradients gradients;
+
+    void Vertex(const Triangle& tri, int k, float* varyings) const
+    {
+        varyings[0] = tri.p[k].uv.u;
+        varyings[1] = tri.p[k].uv.v;
+    }
+
+    void Setup(const Triangle& tri, const TriangleSetup& setup, const TextureGradients* found = nullptr)
+    {
+        if (mipMode != MIP_NONE)
+        {
+            if (found)
+                gradients = *found;
+            else
+                gradients.Setup(tri, setup);
+        }
+    }
+
+    bool Covers(const Triangle& tri, const float* varyings) const
+    {
+        return TexelCovered(varyings[0], varyings[1]);
+    }
+
+    bool Fragment(const Triangle& tri, const float* varyings, float depth, RGBColor& color) const
+    {
+        if (!TexelCovered(varyings[0], varyings[1]))
+            return false;
+
+        float lod = mipMode != MIP_NONE ? gradients.Lod(varyings[0], varyings[1], depth) : 0;
+        color = SampleTexture(varyings[0], varyings[1], lod, features & PIPE_FILTER);
+        return true;
+    }
+};
+
+
+// Vertex colors only
+template <int features>
+struct VertexColorShader
+{
+    static const int varyingCount = 3; // Vertex color
+    static const int usedFeatures = 0;
+    static const int coverageFeatures = 0;
+
+    void Vertex(const Triangle& tri, int k, float* varyings) const
+    {
+        // Vertex colors are stored as the amount to darken by
+        varyings[0] = 255 - tri.p[k].light.r;
+        varyings[1] = 255 - tri.p[k].light.g;
+        varyings[2] = 255 - tri.p[k].light.b;
+    }
+
+    void Setup(const Triangle& tri, const TriangleSetup& setup, const TextureGradients* found = nullptr)
+    {
+    }
+
+    bool Covers(const Triangle& tri, const float* varyings) const
+    {
+        return true;
+    }
+
+    bool Fragment(const Triangle& tri, const float* varyings, float depth, RGBColor& color) const
+    {
+        color = { uint8_t(varyings[0]), uint8_t(varyings[1]), uint8_t(varyings[2]) };
+        return true;
+    }
+};
+
+
+// Debug view of the distance from the camera, brighter is closer
+template <int features>
+struct DebugDepthShader
+{
+    static const int varyingCount = 0;
+    static const int usedFeatures = 0;
+    static const int coverageFeatures = 0;
+
+    void Vertex(const Triangle& tri, int k, float* varyings) const
+    {
+    }
+
+    void Setup(const Triangle& tri, const TriangleSetup& setup, const TextureGradients* found = nullptr)
+    {
+    }
+
+    bool Covers(const Triangle& tri, const float* varyings) const
+    {
+        return true;
+    }
+
+    bool Fragment(const Triangle& tri, const float* varyings, float depth, RGBColor& color) const
+    {
+        float brightness = 255 - (1 / depth) * 4;
+        uint8_t shade = brightness < 0 ? 0 : uint8_t(brightness);
+        color = { shade, shade, shade };
+        return true;
+    }
+};
+
+
+// Debug view of the texture coordinates as red and green
+template <int features>
+struct DebugUVShader
+{
+    static const int varyingCount = 2; // u, v
+    static const int usedFeatures = 0;
+    static const int coverageFeatures = 0;
+
+    void Vertex(const Triangle& tri, int k, float* varyings) const
+    {
+        varyings[0] = tri.p[k].uv.u;
+        varyings[1] = tri.p[k].uv.v;
+    }
+
+    void Setup(const Triangle& tri, const TriangleSetup& setup, const TextureGradients* found = nullptr)
+    {
+    }
+
+    bool Covers(const Triangle& tri, const float* varyings) const
+    {
+        return true;
+    }
+
+    bool Fragment(const Triangle& tri, const float* varyings, float depth, RGBColor& color) const
+    {
+        float u = varyings[0] - floorf(varyings[0]);
+        float v = varyings[1] - floorf(varyings[1]);
+        color = { uint8_t(u * 255), uint8_t(v * 255), 0 };
+        return true;
+    }
+};
+
+
+bool SetupTriangle(const Triangle& tri, TriangleSetup& setup)
+{
+    // Snap the projected points onto the sub-pixel grid.
+    // Points far outside the screen are held to the guard band so the fixed-point math can't overflow.
+    float guardBand = float(max(screenWidth, screenHeight)) * 64;
+
+    for (int k = 0; k < 3; k++)
+    {
+        float x = tri.p[k].coord.x * screenWidth;
+        float y = tri.p[k].coord.y * screenHeight;
+
+        if (x > guardBand)
+            x = guardBand;
+        if (x < -guardBand)
+            x = -guardBand;
+        if (y > guardBand)
+            y = guardBand;
+        if (y < -guardBand)
+            y = -guardBand;
+
+        setup.x[k] = (int64_t)lrintf(x * subPixelScale);
+        setup.y[k] = (int64_t)lrintf(y * subPixelScale);
+        setup.invZ[k] = tri.p[k].coord.z;
+        setup.vertex[k] = k;
+    }
+
+    // Twice the signed area of the snapped triangle
+    int64_t area = (setup.x[1] - setup.x[0]) * (setup.y[2] - setup.y[0]) - (setup.y[1] - setup.y[0]) * (setup.x[2] - setup.x[0]);
+
+    if (area == 0)
+        return false; // Degenerate, covers no pixels
+
+    // Keep a single winding so every edge function is positive inside the triangle.
+    if (area < 0)
+    {
+        swap(setup.x[1], setup.x[2]);
+        swap(setup.y[1], setup.y[2]);
+        swap(setup.invZ[1], setup.invZ[2]);
+        swap(setup.vertex[1], setup.vertex[2]);
+        area = -area;
+    }
+
+    setup.invArea = 1.0f / float(area);
+    setup.maxDepth = max(setup.invZ[0], max(setup.invZ[1], setup.invZ[2]));
+
+    // Pixel bounds of the triangle, limited to the screen
+    int64_t minX = min(setup.x[0], min(setup.x[1], setup.x[2]));
+    int64_t maxX = max(setup.x[0], max(setup.x[1], setup.x[2]));
+    int64_t minY = min(setup.y[0], min(setup.y[1], setup.y[2]));
+    int64_t maxY = max(setup.y[0], max(setup.y[1], setup.y[2]));
+
+    setup.minX = int(max<int64_t>(minX >> subPixelBits, 0));
+    setup.maxX = int(min<int64_t>(maxX >> subPixelBits, screenWidth - 1));
+    setup.minY = int(max<int64_t>(minY >> subPixelBits, 0));
+    setup.maxY = int(min<int64_t>(maxY >> subPixelBits, screenHeight - 1));
 
-    sample1.r *= (1 - offset_x - offset_y + totalOffset);
-    sample1.g *= (1 - offset_x - offset_y + totalOffset);
-    sample1.b *= (1 - offset_x - offset_y + totalOffset);
+    if (setup.minX > setup.maxX || setup.minY > setup.maxY)
+        return false;
 
-    sample2.r *= offset_x - totalOffset;
-    sample2.g *= offset_x - totalOffset;
-    sample2.b *= offset_x - totalOffset;
+    // Edge k is opposite vertex k, so its value is the barycentric weight of vertex k.
+    // Edge function: E(px, py) = stepX * px + stepY * py + c
+    for (int k = 0; k < 3; k++)
+    {
+        int a = (k + 1) % 3;
+        int b = (k + 2) % 3;
 
-    sample3.r *= offset_y - totalOffset;
-    sample3.g *= offset_y - totalOffset;
-    sample3.b *= offset_y - totalOffset;
+        int64_t dx = setup.x[b] - setup.x[a];
+        int64_t dy = setup.y[b] - setup.y[a];
 
-    sample4.r *= totalOffset;
-    sample4.g *= totalOffset;
-    sample4.b *= totalOffset;
+        setup.edgeStepX[k] = -dy;
+        setup.edgeStepY[k] = dx;
 
-    // Add the colors together
-    return { uint8_t(sample1.r + sample2.r + sample3.r + sample4.r), uint8_t(sample1.g + sample2.g + sample3.g + sample4.g), uint8_t(sample1.b + sample2.b + sample3.b + sample4.b) };
+        // Top-left fill rule: pixels exactly on an edge belong to the triangle only if it is a top or left edge.
+        // With y pointing down, a top edge is flat with the triangle below it, a left edge goes up the screen.
+        bool topLeft = (dy == 0 && dx > 0) || dy < 0;
+
+        // Evaluate at the center of the first pixel of the bounding box
+        int64_t px = (int64_t(setup.minX) << subPixelBits) + (subPixelScale >> 1);
+        int64_t py = (int64_t(setup.minY) << subPixelBits) + (subPixelScale >> 1);
+
+        setup.edgeStart[k] = dx * (py - setup.y[a]) - dy * (px - setup.x[a]) + (topLeft ? 0 : -1);
+    }
+
+    return true;
 }
 
 
-RGBColor FilterBloom(float x, float y)
+float InterpolateDepth(const TriangleSetup& setup, float b0, float b1)
 {
-    // Wrap the coordinates on the texture for tiling
+    // The depth pre-pass relies on this giving the same result every time it is called for a pixel
+    return (setup.invZ[0] * b0) + (setup.invZ[1] * b1) + (setup.invZ[2] * (1 - b0 - b1));
+}
 
 
-    // find the distance the point is between pixels so add weight to each sample for filtering
-    // Use the wrapped coordinates to find the correct pixel on the texture
+// Convert depth to a unorm depth format. 1/z can't go past 1/cameraNear, which becomes the largest value.
+inline uint32_t QuantizeDepth(float depth, int format)
+{
+    float largest = (format == DEPTH_UNORM16) ? 65535.0f : 16777215.0f;
+    return uint32_t(min(depth * cameraNear, 1.0f) * largest + 0.5f);
+}
 
 
-    // Find the pixels around the sampled pixel
-    x -= 0.5;
-    y -= 0.5;
+// Test depth against the depth buffer in the current depth format.
+// The format is the same for the whole frame, so the branch on it is always predicted.
+template <int features>
+inline bool DepthPasses(int index, float depth)
+{
+    if (depthFormat == DEPTH_FLOAT)
+        return (features & PIPE_DEPTH_EQUAL) ? depth == depthBuffer[index] : depth > depthBuffer[index];
 
-    int roundDownX = (x);
-    int roundDownY = (y);
-    int roundUpX = (x + 1);
-    int roundUpY = (y + 1);
+    uint32_t stored = (depthFormat == DEPTH_UNORM16) ? depthBuffer16[index] : depthBuffer24[index];
+    uint32_t value = QuantizeDepth(depth, depthFormat);
+    return (features & PIPE_DEPTH_EQUAL) ? value == stored : value > stored;
+}
 
-    if (roundUpX >= 32)
-        roundUpX = 31;
-    if (roundUpY >= 32)
-        roundUpY = 31;
-    if (roundDownX < 0)
-        roundDownX = 0;
-    if (roundDownY < 0)
-        roundDownY = 0;
 
-    RGBFloat sample1 = bloomTexture.px[roundDownX + (roundDownY * 32)];
-    RGBFloat sample2 = bloomTexture.px[roundUpX + (roundDownY * 32)];
-    RGBFloat sample3 = bloomTexture.px[roundDownX + (roundUpY * 32)];
-    RGBFloat sample4 = bloomTexture.px[roundUpX + (roundUpY * 32)];
+inline void WriteDepth(int index, float depth)
+{
+    if (depthFormat == DEPTH_UNORM16)
+        depthBuffer16[index] = uint16_t(QuantizeDepth(depth, DEPTH_UNORM16));
+    else if (depthFormat == DEPTH_UNORM24)
+        depthBuffer24[index] = QuantizeDepth(depth, DEPTH_UNORM24);
+    else
+        depthBuffer[index] = depth;
+}
 
-    float offset_x = (x - roundDownX);
-    float offset_y = (y - roundDownY);
-    float totalOffset = offset_x * offset_y;
 
-    sample1.r *= (1 - offset_x - offset_y + totalOffset);
-    sample1.g *= (1 - offset_x - offset_y + totalOffset);
-    sample1.b *= (1 - offset_x - offset_y + totalOffset);
+inline int PixelIndex(int i, int j)
+{
+    // Tiled, each tile is stored as 8 rows of 8 pixels, one tile after another along each row of tiles
+    if (tiledFramebuffer)
+        return ((((i >> tileShift) * tilesX) + (j >> tileShift)) << (tileShift * 2)) + ((i & (tileSize - 1)) << tileShift) + (j & (tileSize - 1));
 
-    sample2.r *= offset_x - totalOffset;
-    sample2.g *= offset_x - totalOffset;
-    sample2.b *= offset_x - totalOffset;
+    return (i * screenPitch) + j;
+}
 
-    sample3.r *= offset_y - totalOffset;
-    sample3.g *= offset_y - totalOffset;
-    sample3.b *= offset_y - totalOffset;
 
-    sample4.r *= totalOffset;
-    sample4.g *= totalOffset;
-    sample4.b *= totalOffset;
+const RGBColor* LinearScreenData()
+{
+    if (!tiledFramebuffer)
+        return screenColorData;
 
-    // Add the colors together
-    return { uint8_t(sample1.r + sample2.r + sample3.r + sample4.r), uint8_t(sample1.g + sample2.g + sample3.g + sample4.g), uint8_t(sample1.b + sample2.b + sample3.b + sample4.b) };
+    // Each row of a tile is copied in one go
+    for (int i = 0; i < screenHeight; i++)
+    {
+        for (int j = 0; j < screenWidth; j += tileSize)
+        {
+            const RGBColor* tileRow = screenColorData + PixelIndex(i, j);
+            copy(tileRow, tileRow + min(tileSize, screenWidth - j), linearColorData + (i * screenPitch) + j);
+        }
+    }
+
+    return linearColorData;
 }
 
 
-float CalculateNormal(Triangle tri)
+inline bool SkipShading(int i, int j)
 {
-    // Use Cross Product formula to find the normal of the triangle. Only draw triangles with a normal facing the camera
+    return checkerboardActive && ((i + j) & 1) != checkerboardParity;
+}
 
-    Vector3 normal;
-    normal.x = ((tri.p[1].coord.y - tri.p[0].coord.y) * (tri.p[2].coord.z - tri.p[0].coord.z)) - ((tri.p[1].coord.z - tri.p[0].coord.z) * (tri.p[2].coord.y - tri.p[0].coord.y));
-    normal.y = ((tri.p[1].coord.z - tri.p[0].coord.z) * (tri.p[2].coord.x - tri.p[0].coord.x)) - ((tri.p[1].coord.x - tri.p[0].coord.x) * (tri.p[2].coord.z - tri.p[0].coord.z));
-    normal.z = ((tri.p[1].coord.x - tri.p[0].coord.x) * (tri.p[2].coord.y - tri.p[0].coord.y)) - ((tri.p[1].coord.y - tri.p[0].coord.y) * (tri.p[2].coord.x - tri.p[0].coord.x));
 
-    // Normalize the face's normal vector
+float StoredDepth(int index)
+{
+    if (depthFormat == DEPTH_UNORM16)
+        return float(depthBuffer16[index]) / (65535.0f * cameraNear);
+    if (depthFormat == DEPTH_UNORM24)
+        return float(depthBuffer24[index]) / (16777215.0f * cameraNear);
 
-    float vecLength = 1 / sqrt(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
-    normal.x *= vecLength;
-    normal.y *= vecLength;
-    normal.z *= vecLength;
+    return depthBuffer[index];
+}
 
-    Vector3 vec3;
-    float vecLength2 = 1 / sqrt(tri.p[0].coord.x * tri.p[0].coord.x + tri.p[0].coord.y * tri.p[0].coord.y + tri.p[0].coord.z * tri.p[0].coord.z);
-    vec3.x = tri.p[0].coord.x * vecLength2;
-    vec3.y = tri.p[0].coord.y * vecLength2;
-    vec3.z = tri.p[0].coord.z * vecLength2;
 
-    // Return the dot product
-    return (normal.x * vec3.x) + (normal.y * vec3.y) + (normal.z * vec3.z);
+bool IsFarPixel(int index)
+{
+    // The threshold is quantized the same way as the stored depth
+    if (depthFormat == DEPTH_UNORM16)
+        return depthBuffer16[index] < QuantizeDepth(blurStartDepth, DEPTH_UNORM16);
+    if (depthFormat == DEPTH_UNORM24)
+        return depthBuffer24[index] < QuantizeDepth(blurStartDepth, DEPTH_UNORM24);
+
+    return depthBuffer[index] < blurStartDepth;
 }
 
 
+void DrawTriangle(Triangle tri)
+{
+    // The compiled pipeline for the instance's material and the current settings was picked by SelectPipeline
+    const MaterialPipeline& pipeline = materialPipelines[loadedMeshInstances[currentInstance].material];
+
+    if (visibilityBufferMode)
+        pipeline.drawVisibility(tri);
+    else if (drawPass == PASS_DEPTH)
+        pipeline.drawDepth(tri);
+    else if (Multisampling())
+        pipeline.drawMultisample(tri);
+    else
+        pipeline.draw(tri);
+}
+
 
-void LoadAssets()
+// Features that change nothing for a mask are removed, so identical variants are only compiled once
+constexpr int CanonicalFeatures(int features)
 {
-    // Load textures
-    int x, y, comps;
-    unsigned char* texData = stbi_load("testTexture.png", &x, &y, &comps, 3);
+    return !(features & PIPE_FILL) ? features & PIPE_DEPTH_EQUAL :
+        (features & PIPE_FLAT) ? features & ~PIPE_FILTER : features;
+}
+
+
+// Barycentric weights with perspective correction.
+// Vertices further from the camera pull the colors and textures towards themselves.
+inline void PerspectiveWeights(const TriangleSetup& setup, float b0, float b1, float depth, float& p1Weight, float& p2Weight, float& p3Weight)
+{
+    float invDepth = 1 / depth;
+    p1Weight = b0 * setup.invZ[0] * invDepth;
+    p2Weight = b1 * setup.invZ[1] * invDepth;
+    p3Weight = 1 - p1Weight - p2Weight;
+}
+
+
+template <int count>
+inline void InterpolateVaryings(const float varyings[3][VaryingSlots(count)], float p1Weight, float p2Weight, float p3Weight, float* out)
+{
+    for (int n = 0; n < count; n++)
+        out[n] = (varyings[0][n] * p1Weight) + (varyings[1][n] * p2Weight) + (varyings[2][n] * p3Weight);
+}
+
+
+// Puts the points of a triangle in the winding order of its setup
+Triangle SortedTriangle(const Triangle& tri, const TriangleSetup& setup)
+{
+    Triangle sorted = tri;
+    sorted.p[0] = tri.p[setup.vertex[0]];
+    sorted.p[1] = tri.p[setup.vertex[1]];
+    sorted.p[2] = tri.p[setup.vertex[2]];
+    return sorted;
+}
+
+
+void UpdateTileDepth(int tileX, int tileY, bool multisample)
+{
+    int x0 = tileX << tileShift;
+    int y0 = tileY << tileShift;
+    int x1 = min(x0 + tileSize, screenWidth);
+    int y1 = min(y0 + tileSize, screenHeight);
+
+    float furthest = 1e30f;
+
+    for (int i = y0; i < y1; i++)
+    {
+        for (int j = x0; j < x1; j++)
+        {
+            int index = PixelIndex(i, j);
+
+            if (multisample)
+            {
+                for (int s = 0; s < sampleCount; s++)
+                    furthest = min(furthest, sampleDepthBuffer[(index * sampleCount) + s]);
+            }
+            // Unorm values up to 24 bits are exact as floats
+            else if (depthFormat == DEPTH_UNORM16)
+                furthest = min(furthest, float(depthBuffer16[index]));
+            else if (depthFormat == DEPTH_UNORM24)
+                furthest = min(furthest, float(depthBuffer24[index]));
+            else
+                furthest = min(furthest, depthBuffer[index]);
+        }
+    }
+
+    tileMinDepth[tileY * tilesX + tileX] = furthest;
+}
+
+
+void SampleEdgeOffsets(const TriangleSetup& setup, int64_t offsets[3][sampleCount])
+{
+    for (int k = 0; k < 3; k++)
+        for (int s = 0; s < sampleCount; s++)
+            offsets[k][s] = (setup.edgeStepX[k] * sampleOffsetX[s]) + (setup.edgeStepY[k] * sampleOffsetY[s]);
+}
+
+
+// Calls pixel(i, j, w0, w1, w2, coverage) for each pixel center inside the triangle. The pixel function returns true if it wrote depth.
+// With multisample, it is called for each pixel with any sample inside, and coverage has a bit for each of them.
+// The triangle is walked in 8x8 tiles, and tiles whose stored depth is all nearer than the triangle are skipped.
+template <int features, bool multisample = false, class PixelFunc>
+inline void TraverseTriangle(const TriangleSetup& setup, PixelFunc&& pixel)
+{
+    // Nearest depth of the triangle in the units of the depth format. Quantizing never changes the order of depths.
+    // Samples always keep float depth.
+    float nearest = (depthFormat != DEPTH_FLOAT && !multisample) ? float(QuantizeDepth(setup.maxDepth, depthFormat)) : setup.maxDepth;
+
+    int64_t sampleOffsets[3][sampleCount];
+    int64_t margin[3] = { 0, 0, 0 }; // Furthest a sample's edge value can be from the pixel center's
+
+    if (multisample)
+    {
+        SampleEdgeOffsets(setup, sampleOffsets);
+
+        for (int k = 0; k < 3; k++)
+            for (int s = 0; s < sampleCount; s++)
+                margin[k] = max(margin[k], sampleOffsets[k][s] < 0 ? -sampleOffsets[k][s] : sampleOffsets[k][s]);
+    }
+
+    // Edge function steps for one pixel across and one pixel down
+    int64_t stepX[3];
+    int64_t stepY[3];
 
-    //Texture addTexture;
+    for (int k = 0; k < 3; k++)
+    {
+        stepX[k] = setup.edgeStepX[k] << subPixelBits;
+        stepY[k] = setup.edgeStepY[k] << subPixelBits;
+    }
 
-    if (texData)
+    for (int tileY = setup.minY >> tileShift; tileY <= setup.maxY >> tileShift; tileY++)
     {
-        for (int i = 0; i < 16384; i++)
+        int y0 = max(tileY << tileShift, setup.minY);
+        int y1 = min((tileY << tileShift) + tileSize - 1, setup.maxY);
+
+        for (int tileX = setup.minX >> tileShift; tileX <= setup.maxX >> tileShift; tileX++)
         {
-            unsigned char* pixelOffset = texData + (i) * 3;
+            int tile = tileY * tilesX + tileX;
+
+            // The nearest point of a triangle is one of its corners, so if that is behind everything in the tile, nothing can pass
+            if (hierarchicalZ && ((features & PIPE_DEPTH_EQUAL) ? nearest < tileMinDepth[tile] : nearest <= tileMinDepth[tile]))
+                continue;
+
+            int x0 = max(tileX << tileShift, setup.minX);
+            int x1 = min((tileX << tileShift) + tileSize - 1, setup.maxX);
+
+            // Edge values at the first pixel of the tile
+            int64_t rowStart[3];
+            bool outside = false;
+            bool inside = true;
+
+            for (int k = 0; k < 3; k++)
+            {
+                rowStart[k] = setup.edgeStart[k] + stepX[k] * (x0 - setup.minX) + stepY[k] * (y0 - setup.minY);
+
+                // Edges are linear, so checking the corner pixels tells if the tile is fully outside or inside
+                int64_t right = stepX[k] * (x1 - x0);
+                int64_t down = stepY[k] * (y1 - y0);
+                int64_t c0 = rowStart[k];
+                int64_t c1 = c0 + right;
+                int64_t c2 = c0 + down;
+                int64_t c3 = c0 + right + down;
+
+                // Samples can be slightly further out than the pixel centers
+                if (((c0 + margin[k]) & (c1 + margin[k]) & (c2 + margin[k]) & (c3 + margin[k])) < 0)
+                    outside = true;
+                if (((c0 - margin[k]) | (c1 - margin[k]) | (c2 - margin[k]) | (c3 - margin[k])) < 0)
+                    inside = false;
+            }
+
+            if (outside)
+                continue;
+
+            // The tile still holds the last frame until a triangle first reaches it
+            if (tileClearEpoch[tile] != clearEpoch)
+                ClearTile(tileX, tileY);
+
+            bool wrote = false;
+
+            for (int i = y0; i <= y1; i++)
+            {
+                int64_t w0 = rowStart[0];
+                int64_t w1 = rowStart[1];
+                int64_t w2 = rowStart[2];
 
-            RGBColor pixel = { pixelOffset[0], pixelOffset[1], pixelOffset[2] };
+                for (int j = x0; j <= x1; j++)
+                {
+                    // Pixels well inside every edge have all of their samples covered
+                    if (multisample && w0 >= margin[0] && w1 >= margin[1] && w2 >= margin[2])
+                    {
+                        wrote |= pixel(i, j, w0, w1, w2, allSamples);
+                    }
+                    else if (multisample)
+                    {
+                        int coverage = 0;
+
+                        for (int s = 0; s < sampleCount; s++)
+                            if (((w0 + sampleOffsets[0][s]) | (w1 + sampleOffsets[1][s]) | (w2 + sampleOffsets[2][s])) >= 0)
+                                coverage |= 1 << s;
+
+                        if (coverage != 0)
+                            wrote |= pixel(i, j, w0, w1, w2, coverage);
+                    }
+                    // The pixel center is inside when all three edge functions agree
+                    else if ((w0 | w1 | w2) >= 0)
+                    {
+                        wrote |= pixel(i, j, w0, w1, w2, allSamples);
+                    }
+
+                    w0 += stepX[0];
+                    w1 += stepX[1];
+                    w2 += stepX[2];
+                }
+
+                rowStart[0] += stepY[0];
+                rowStart[1] += stepY[1];
+                rowStart[2] += stepY[2];
+            }
 
-            loadedTexture.px[(127 - i / 128) * 128 + (i % 128)] = pixel;
+            // A triangle covering the whole tile is likely to have pushed its furthest depth closer
+            if (hierarchicalZ && wrote && inside && x0 == tileX << tileShift && y0 == tileY << tileShift)
+                UpdateTileDepth(tileX, tileY, multisample);
         }
     }
-    
-    stbi_image_free(texData);
+}
 
 
-    // Initialize Loader
-    objl::Loader Loader;
+bool CheckFillRule()
+{
+    // Only coverage is looked at, so the depth tests are turned off while the triangles are walked
+    bool wasHierarchicalZ = hierarchicalZ;
+    hierarchicalZ = false;
 
-    // Load .obj File
-    bool isLoaded = Loader.LoadFile("testModel.obj");
+    vector<uint8_t> covered(size_t(screenWidth) * screenHeight);
+    bool passed = true;
 
-    if (isLoaded)
+    auto draw = [&](Vector3 a, Vector3 b, Vector3 c)
     {
-        for (int i = 0; i < Loader.LoadedMeshes.size(); i++)
+        Triangle tri;
+        tri.p[0].coord = a;
+        tri.p[1].coord = b;
+        tri.p[2].coord = c;
+
+        TriangleSetup setup;
+
+        if (!SetupTriangle(tri, setup))
+            return;
+
+        TraverseTriangle<0>(setup, [&](int i, int j, int64_t w0, int64_t w1, int64_t w2, int coverage)
         {
-            objl::MeshData currentMesh = Loader.LoadedMeshes[i];
-            Mesh newMesh;
+            covered[j + (i * screenWidth)]++;
+            return false;
+        });
+    };
 
-            for (int j = 0; j < currentMesh.Indices.size(); j += 3)
+    // Pixels with their center well inside a shape must be covered once, and no pixel more than once
+    auto check = [&](float left, float right, float bottom, float top)
+    {
+        for (int i = 0; i < screenHeight; i++)
+        {
+            for (int j = 0; j < screenWidth; j++)
             {
-                Triangle newTri;
-                newTri.p[0].coord.x = currentMesh.Vertices[currentMesh.Indices[j]].Position.X;
-                newTri.p[0].coord.y = currentMesh.Vertices[currentMesh.Indices[j]].Position.Y;
-                newTri.p[0].coord.z = currentMesh.Vertices[currentMesh.Indices[j]].Position.Z;
-                newTri.p[1].coord.x = currentMesh.Vertices[currentMesh.Indices[j + 1]].Position.X;
-                newTri.p[1].coord.y = currentMesh.Vertices[currentMesh.Indices[j + 1]].Position.Y;
-                newTri.p[1].coord.z = currentMesh.Vertices[currentMesh.Indices[j + 1]].Position.Z;
-                newTri.p[2].coord.x = currentMesh.Vertices[currentMesh.Indices[j + 2]].Position.X;
-                newTri.p[2].coord.y = currentMesh.Vertices[currentMesh.Indices[j + 2]].Position.Y;
-                newTri.p[2].coord.z = currentMesh.Vertices[currentMesh.Indices[j + 2]].Position.Z;
+                float x = (j + 0.5f) / screenWidth;
+                float y = (i + 0.5f) / screenHeight;
+                bool inside = x > left + (2.0f / screenWidth) && x < right - (2.0f / screenWidth) && y > bottom + (2.0f / screenHeight) && y < top - (2.0f / screenHeight);
 
-                newTri.p[0].uv.u = currentMesh.Vertices[currentMesh.Indices[j]].TextureCoordinate.X;
-                newTri.p[0].uv.v = currentMesh.Vertices[currentMesh.Indices[j]].TextureCoordinate.Y;
-                newTri.p[1].uv.u = currentMesh.Vertices[currentMesh.Indices[j + 1]].TextureCoordinate.X;
-                newTri.p[1].uv.v = currentMesh.Vertices[currentMesh.Indices[j + 1]].TextureCoordinate.Y;
-                newTri.p[2].uv.u = currentMesh.Vertices[currentMesh.Indices[j + 2]].TextureCoordinate.X;
-                newTri.p[2].uv.v = currentMesh.Vertices[currentMesh.Indices[j + 2]].TextureCoordinate.Y;
+                if (covered[j + (i * screenWidth)] > 1 || (inside && covered[j + (i * screenWidth)] != 1))
+                    passed = false;
+            }
+        }
 
-                newTri.p[0].light.r = 255 - currentMesh.Vertices[currentMesh.Indices[j]].Color.X * 255;
-                newTri.p[0].light.g = 255 - currentMesh.Vertices[currentMesh.Indices[j]].Color.Y * 255;
-                newTri.p[0].light.b = 255 - currentMesh.Vertices[currentMesh.Indices[j]].Color.Z * 255;
-                newTri.p[1].light.r = 255 - currentMesh.Vertices[currentMesh.Indices[j + 1]].Color.X * 255;
-                newTri.p[1].light.g = 255 - currentMesh.Vertices[currentMesh.Indices[j + 1]].Color.Y * 255;
-                newTri.p[1].light.b = 255 - currentMesh.Vertices[currentMesh.Indices[j + 1]].Color.Z * 255;
-                newTri.p[2].light.r = 255 - currentMesh.Vertices[currentMesh.Indices[j + 2]].Color.X * 255;
-                newTri.p[2].light.g = 255 - currentMesh.Vertices[currentMesh.Indices[j + 2]].Color.Y * 255;
-                newTri.p[2].light.b = 255 - currentMesh.Vertices[currentMesh.Indices[j + 2]].Color.Z * 255;
+        fill(covered.begin(), covered.end(), 0);
+    };
+
+    // A square cut into a grid of triangles, with the inner corners moved off the sub-pixel grid in a repeatable pattern
+    const int grid = 13;
+    Vector3 corners[grid + 1][grid + 1];
+
+    for (int y = 0; y <= grid; y++)
+    {
+        for (int x = 0; x <= grid; x++)
+        {
+            float jitterX = (x > 0 && x < grid) ? ((((x * 7) + (y * 13)) % 11) - 5) * 0.0013f : 0;
+            float jitterY = (y > 0 && y < grid) ? ((((x * 5) + (y * 3)) % 9) - 4) * 0.0017f : 0;
+            corners[y][x] = { 0.1f + (x * 0.8f / grid) + jitterX, 0.1f + (y * 0.8f / grid) + jitterY, 1 };
+        }
+    }
+
+    for (int y = 0; y < grid; y++)
+    {
+        for (int x = 0; x < grid; x++)
+        {
+            draw(corners[y][x], corners[y][x + 1], corners[y + 1][x + 1]);
+            draw(corners[y][x], corners[y + 1][x + 1], corners[y + 1][x]);
+        }
+    }
+
+    check(0.1f, 0.9f, 0.1f, 0.9f);
+
+    // A fan of thin triangles around a point, so every edge has a different slope, wound both ways
+    const int spokes = 37;
+    Vector3 center = { 0.5f, 0.5f, 1 };
+
+    for (int k = 0; k < spokes; k++)
+    {
+        float angle0 = k * 6.2831853f / spokes;
+        float angle1 = (k + 1) * 6.2831853f / spokes;
+        Vector3 a = { 0.5f + cosf(angle0) * 0.8f, 0.5f + sinf(angle0) * 0.8f, 1 };
+        Vector3 b = { 0.5f + cosf(angle1) * 0.8f, 0.5f + sinf(angle1) * 0.8f, 1 };
+
+        if (k % 2)
+            draw(center, a, b);
+        else
+            draw(center, b, a);
+    }
+
+    // The fan reaches past the screen on every side, so the whole screen is inside it
+    check(0, 1, 0, 1);
+
+    hierarchicalZ = wasHierarchicalZ;
+
+    return passed;
+}
+
+
+template <class Shader, int features>
+inline bool PipelineCovers(const Shader& shader, const Triangle& tri, const TriangleSetup& setup, const float varyings[3][VaryingSlots(Shader::varyingCount)], float b0, float b1, float depth)
+{
+    // Transparent texels must not hide what is behind them, so they are tested before any depth is written
+    float p1Weight, p2Weight, p3Weight;
+    PerspectiveWeights(setup, b0, b1, depth, p1Weight, p2Weight, p3Weight);
+
+    float pixelVaryings[VaryingSlots(Shader::varyingCount)];
+    InterpolateVaryings<Shader::varyingCount>(varyings, p1Weight, p2Weight, p3Weight, pixelVaryings);
+
+    return shader.Covers(tri, pixelVaryings);
+}
+
+
+template <class Shader, int features>
+void DrawTrianglePipeline(const Triangle& tri)
+{
+    TriangleSetup setup;
+
+    if (!SetupTriangle(tri, setup))
+        return;
+
+    // Vertex data in the winding order used by the setup
+    Triangle sorted = SortedTriangle(tri, setup);
+
+    Shader shader;
+    float varyings[3][VaryingSlots(Shader::varyingCount)];
+
+    for (int k = 0; k < 3; k++)
+        shader.Vertex(sorted, k, varyings[k]);
+
+    shader.Setup(sorted, setup);
+
+    TraverseTriangle<features>(setup, [&](int i, int j, int64_t w0, int64_t w1, int64_t w2, int coverage)
+    {
+        // Screen-space barycentric weights. 1/z is linear in screen space, so depth can be interpolated directly.
+        float b0 = float(w0) * setup.invArea;
+        float b1 = float(w1) * setup.invArea;
 
-                newMesh.tris.emplace_back(newTri);
-            }
+        float depth = InterpolateDepth(setup, b0, b1);
+        int index = PixelIndex(i, j);
+
+        // After a depth pre-pass only the nearest triangle at each pixel matches the stored depth exactly
+        if (!DepthPasses<features>(index, depth))
+            return false;
 
-            loadedMeshes.emplace_back(newMesh);
+        // Without fill, triangles only write depth so they still hide the wireframe behind them.
+        // Pixels left for checkerboard reconstruction need their depth too.
+        if (!(features & PIPE_FILL) || SkipShading(i, j))
+        {
+            if (!PipelineCovers<Shader, features>(shader, sorted, setup, varyings, b0, b1, depth))
+                return false;
+
+            WriteDepth(index, depth);
+            return true;
         }
-    }
-    
-    // Make one instance of each mesh for now
-    for (int i = 0; i < 1; i++)
-    {
-        MeshInstance newInstance;
-        newInstance.instanceMesh = loadedMeshes[i];
-        loadedMeshInstances.emplace_back(newInstance);
-    }
-}
 
+        float p1Weight, p2Weight, p3Weight;
+        PerspectiveWeights(setup, b0, b1, depth, p1Weight, p2Weight, p3Weight);
 
-Vector3 Translate(Vector3 vect, Vector3 vect2)
-{
-    vect.x += vect2.x;
-    vect.y += vect2.y;
-    vect.z += vect2.z;
+        float pixelVaryings[VaryingSlots(Shader::varyingCount)];
+        InterpolateVaryings<Shader::varyingCount>(varyings, p1Weight, p2Weight, p3Weight, pixelVaryings);
 
-    return vect;
+        RGBColor vertexWeightedCol;
+
+        if (!shader.Fragment(sorted, pixelVaryings, depth, vertexWeightedCol))
+            return false;
+
+        screenColorData[index] = vertexWeightedCol;
+        WriteDepth(index, depth);
+        return true;
+    });
 }
 
 
-Vector3 Rotate(Vector3 vect, Vector3 rot)
+template <class Shader, int features>
+void DrawTriangleDepthPipeline(const Triangle& tri)
 {
-    Vector3 returnVect;
+    TriangleSetup setup;
 
-    returnVect.x = vect.x * (cos(rot.y) * cos(rot.x)) +
-        vect.y * (sin(rot.z) * sin(rot.y) * cos(rot.x) - cos(rot.z) * sin(rot.x)) +
-        vect.z * (cos(rot.z) * sin(rot.y) * cos(rot.x) + sin(rot.z) * sin((rot.x)));
-    
-    returnVect.y = vect.x * (cos(rot.y) * sin(rot.x)) +
-        vect.y * (sin(rot.z) * sin(rot.y) * sin(rot.x) + cos(rot.z) * cos(rot.x)) +
-        vect.z * (cos(rot.z) * sin(rot.y) * sin(rot.x) - sin(rot.z) * cos((rot.x)));
+    if (!SetupTriangle(tri, setup))
+        return;
 
-    returnVect.z = vect.x * (-sin(rot.y)) +
-        vect.y * (sin(rot.z) * cos(rot.y)) +
-        vect.z * (cos(rot.z) * cos(rot.y));
+    Triangle sorted = SortedTriangle(tri, setup);
 
-    return returnVect;
+    Shader shader;
+    float varyings[3][VaryingSlots(Shader::varyingCount)];
+
+    for (int k = 0; k < 3; k++)
+        shader.Vertex(sorted, k, varyings[k]);
+
+    TraverseTriangle<features>(setup, [&](int i, int j, int64_t w0, int64_t w1, int64_t w2, int coverage)
+    {
+        float b0 = float(w0) * setup.invArea;
+        float b1 = float(w1) * setup.invArea;
+
+        float depth = InterpolateDepth(setup, b0, b1);
+        int index = PixelIndex(i, j);
+
+        if (!DepthPasses<features>(index, depth) || !PipelineCovers<Shader, features>(shader, sorted, setup, varyings, b0, b1, depth))
+            return false;
+
+        WriteDepth(index, depth);
+        return true;
+    });
 }
 
 
-void ClipAndDraw(Triangle tri)
+template <class Shader, int features>
+void DrawTriangleVisibilityPipeline(const Triangle& tri)
 {
-    // Clips triangles against one plane at a time.
-    // Each time it is clipped, clip each of the resulting triangles against the next plane.
+    VisibleTriangle visible;
 
+    if (!SetupTriangle(tri, visible.setup))
+        return;
 
-    // Clip near
-    vector <Triangle> newTris1; // Create and the new triangles generated from clipping
-    vector <Point> newPoints1; // Clipped points from which new triangles will be constructed
+    visible.tri = SortedTriangle(tri, visible.setup);
+    visible.material = loadedMeshInstances[currentInstance].material;
+    visible.texture = boundTexture.texture;
 
-    for (int p1 = 0; p1 < 3; p1++)
+    const TriangleSetup& setup = visible.setup;
+    uint32_t id = uint32_t(visibleTriangles.size()) + 1;
+    bool touched = false;
+
+    Shader shader;
+    float varyings[3][VaryingSlots(Shader::varyingCount)];
+
+    for (int k = 0; k < 3; k++)
+        shader.Vertex(visible.tri, k, varyings[k]);
+
+    // Only depth and the triangle ID are written, shading happens later
+    TraverseTriangle<features>(setup, [&](int i, int j, int64_t w0, int64_t w1, int64_t w2, int coverage)
     {
-        // If the point is inside screen, include it in newPoints.
-        if (tri.p[p1].coord.z >= cameraNear)
-            newPoints1.emplace_back(tri.p[p1]);
+        float b0 = float(w0) * setup.invArea;
+        float b1 = float(w1) * setup.invArea;
 
-        int p2 = p1 + 1;
-        if (p2 > 2)
-            p2 = 0;
+        float depth = InterpolateDepth(setup, b0, b1);
+        int index = PixelIndex(i, j);
 
-        Point point1 = tri.p[p1];
-        Point point2 = tri.p[p2];
+        if (!DepthPasses<features>(index, depth) || !PipelineCovers<Shader, features>(shader, visible.tri, setup, varyings, b0, b1, depth))
+            return false;
 
-        if (point1.coord.z > point2.coord.z) // p1 has the smaller y.
-            swap(point1, point2);
+        WriteDepth(index, depth);
+        visibilityBuffer[index] = id;
+        touched = true;
+        return true;
+    });
 
-        // Z intersection
-        if (point1.coord.z < cameraNear && point2.coord.z > cameraNear) // Line has points on either side of edge
-        {
-            float a = -(point1.coord.z - cameraNear) / ((point2.coord.z - cameraNear) - (point1.coord.z - cameraNear));
+    // Triangles that never won a pixel don't need to be kept
+    if (!touched)
+        return;
 
-            Point newP;
+    if (mipMode != MIP_NONE)
+        visible.gradients.Setup(visible.tri, setup);
 
-            newP.coord.x = point2.coord.x * a + point1.coord.x * (1 - a);
-            newP.coord.y = point2.coord.y * a + point1.coord.y * (1 - a);
-            newP.coord.z = cameraNear;
+    visibleTriangles.emplace_back(visible);
+}
 
-            newP.uv.u = point2.uv.u * a + point1.uv.u * (1 - a);
-            newP.uv.v = point2.uv.v * a + point1.uv.v * (1 - a);
 
-            newP.light.r = point2.light.r * a + point1.light.r * (1 - a);
-            newP.light.g = point2.light.g * a + point1.light.g * (1 - a);
-            newP.light.b = point2.light.b * a + point1.light.b * (1 - a);
+template <class Shader, int features>
+void DrawTriangleMultisamplePipeline(const Triangle& tri)
+{
+    TriangleSetup setup;
 
-            newPoints1.emplace_back(newP);
-        }
-    }
+    if (!SetupTriangle(tri, setup))
+        return;
 
-    for (int i = 0; i < newPoints1.size(); i++)
+    Triangle sorted = SortedTriangle(tri, setup);
+
+    Shader shader;
+    float varyings[3][VaryingSlots(Shader::varyingCount)];
+
+    for (int k = 0; k < 3; k++)
+        shader.Vertex(sorted, k, varyings[k]);
+
+    shader.Setup(sorted, setup);
+
+    int64_t sampleOffsets[3][sampleCount];
+    SampleEdgeOffsets(setup, sampleOffsets);
+
+    // Depth is linear in screen space, so each sample is a fixed step away from the pixel center
+    float sampleDepthSteps[sampleCount];
+
+    for (int s = 0; s < sampleCount; s++)
     {
-        newPoints1[i].coord.x = newPoints1[i].coord.x / (newPoints1[i].coord.z * fov) + 0.5;
-        newPoints1[i].coord.y = -newPoints1[i].coord.y / (newPoints1[i].coord.z * fov) + 0.5;
-        newPoints1[i].coord.z = 1 / newPoints1[i].coord.z;
+        float b0 = float(sampleOffsets[0][s]) * setup.invArea;
+        float b1 = float(sampleOffsets[1][s]) * setup.invArea;
+        sampleDepthSteps[s] = ((setup.invZ[0] - setup.invZ[2]) * b0) + ((setup.invZ[1] - setup.invZ[2]) * b1);
     }
 
-    if (newPoints1.size() > 2)
+    TraverseTriangle<features, true>(setup, [&](int i, int j, int64_t w0, int64_t w1, int64_t w2, int coverage)
     {
-        for (int i = 0; i < newPoints1.size() - 2; i++)
+        int pixel = PixelIndex(i, j);
+        const float* storedDepths = sampleDepthBuffer + (pixel * sampleCount);
+
+        float b0 = float(w0) * setup.invArea;
+        float b1 = float(w1) * setup.invArea;
+
+        float depth = InterpolateDepth(setup, b0, b1);
+
+        // Depth is tested at every covered sample
+        float sampleDepths[sampleCount];
+        int passed = 0;
+
+        for (int s = 0; s < sampleCount; s++)
         {
-            if (!((newPoints1[0].coord.x < 0 && newPoints1[i + 1].coord.x < 0 && newPoints1[i + 2].coord.x < 0) ||
-                (newPoints1[0].coord.x > 1 && newPoints1[i + 1].coord.x > 1 && newPoints1[i + 2].coord.x > 1) ||
-                (newPoints1[0].coord.y < 0 && newPoints1[i + 1].coord.y < 0 && newPoints1[i + 2].coord.y < 0) ||
-                (newPoints1[0].coord.y > 1 && newPoints1[i + 1].coord.y > 1 && newPoints1[i + 2].coord.y > 1)))
-            {
-                Triangle newTri = { newPoints1[0], newPoints1[i + 1], newPoints1[i + 2] };
-                newTri.lighting = tri.lighting;
-                newTris1.emplace_back(newTri);
-            }
+            sampleDepths[s] = depth + sampleDepthSteps[s];
+
+            if ((coverage & (1 << s)) && sampleDepths[s] > storedDepths[s])
+                passed |= 1 << s;
         }
-    }
-    else
-        return; // Draw nothing
-    
 
-    for (int i = 0; i < newTris1.size(); i++)
-    {
-        DrawTriangle(newTris1[i]);
-    }
+        if (passed == 0)
+            return false;
+
+        // Shading runs once at the pixel center, even if the center itself is outside the triangle
+        float p1Weight, p2Weight, p3Weight;
+        PerspectiveWeights(setup, b0, b1, depth, p1Weight, p2Weight, p3Weight);
+
+        float pixelVaryings[VaryingSlots(Shader::varyingCount)];
+        InterpolateVaryings<Shader::varyingCount>(varyings, p1Weight, p2Weight, p3Weight, pixelVaryings);
+
+        // Without fill, only the sample depths are written
+        if (!(features & PIPE_FILL))
+        {
+            if (!shader.Covers(sorted, pixelVaryings))
+                return false;
+
+            for (int s = 0; s < sampleCount; s++)
+                if (passed & (1 << s))
+                    sampleDepthBuffer[(pixel * sampleCount) + s] = sampleDepths[s];
+
+            return true;
+        }
+
+        RGBColor vertexWeightedCol;
+
+        if (!shader.Fragment(sorted, pixelVaryings, depth, vertexWeightedCol))
+            return false;
+
+        WriteSamples(pixel, passed, vertexWeightedCol, sampleDepths);
+        return true;
+    });
 }
 
 
-void DrawTriangle(Triangle tri)
+inline void WriteSamples(int pixel, int samples, RGBColor color, const float* depths)
 {
-    // The three points for the triangle
-    Point p1 = tri.p[0];
-    Point p2 = tri.p[1];
-    Point p3 = tri.p[2];
+    float* sampleDepths = sampleDepthBuffer + (pixel * sampleCount);
+    RGBColor* sampleColors = sampleColorBuffer + (pixel * sampleCount);
+
+    for (int s = 0; s < sampleCount; s++)
+        if (samples & (1 << s))
+            sampleDepths[s] = depths[s];
+
+    // A pixel fully covered by one triangle only needs one color
+    if (samples == allSamples)
+    {
+        sampleColors[0] = color;
+        pixelCompressed[pixel] = 1;
+        return;
+    }
 
-    // Project the points into 2d space
-    p1.coord.x *= screenResolution;
-    p1.coord.y *= screenResolution;
-    p2.coord.x *= screenResolution;
-    p2.coord.y *= screenResolution;
-    p3.coord.x *= screenResolution;
-    p3.coord.y *= screenResolution;
+    if (pixelCompressed[pixel])
+    {
+        for (int s = 1; s < sampleCount; s++)
+            sampleColors[s] = sampleColors[0];
 
+        pixelCompressed[pixel] = 0;
+    }
 
-    // Sort the points. The topmost point is first, then middle, then bottommost.
-    if (p3.coord.y < p1.coord.y)
-        swap(p3, p1);
-    if (p3.coord.y < p2.coord.y)
-        swap(p3, p2);
-    if (p2.coord.y < p1.coord.y)
-        swap(p2, p1);   
+    for (int s = 0; s < sampleCount; s++)
+        if (samples & (1 << s))
+            sampleColors[s] = color;
+}
 
 
-    // The change in x for every change in y.
-    // Left slope is from 0-1, right is from 1-2, other is from 0-2
-    float leftSlope = 1000;
-    float rightSlope = 1000;
+template <class Shader, int features>
+inline void ShadeVisiblePixel(const Shader& shader, const float varyings[3][VaryingSlots(Shader::varyingCount)], const VisibleTriangle& visible, int i, int j)
+{
+    const TriangleSetup& setup = visible.setup;
 
-    if (int(p3.coord.y) - int(p1.coord.y) != 0)
-        leftSlope = (p1.coord.x - p3.coord.x) / (int(p3.coord.y) - int(p1.coord.y));
-    if (int(p2.coord.y) - int(p1.coord.y) != 0)
-        rightSlope = (p1.coord.x - p2.coord.x) / float(int(p2.coord.y) - int(p1.coord.y));
+    // Rebuild the edge values of this pixel from the stored triangle, the third weight follows from these two
+    int64_t dx = int64_t(j - setup.minX) << subPixelBits;
+    int64_t dy = int64_t(i - setup.minY) << subPixelBits;
 
-    // Set the start and end of the scan lines
-    float scanStart = p1.coord.x;
-    float scanEnd = scanStart;
+    int64_t w0 = setup.edgeStart[0] + setup.edgeStepX[0] * dx + setup.edgeStepY[0] * dy;
+    int64_t w1 = setup.edgeStart[1] + setup.edgeStepX[1] * dx + setup.edgeStepY[1] * dy;
 
+    float b0 = float(w0) * setup.invArea;
+    float b1 = float(w1) * setup.invArea;
 
-    if (leftSlope < rightSlope)
-        swap(leftSlope, rightSlope);
+    // Computed the same way as when it was stored, so it doesn't matter what format the depth buffer uses
+    float depth = InterpolateDepth(setup, b0, b1);
 
+    float p1Weight, p2Weight, p3Weight;
+    PerspectiveWeights(setup, b0, b1, depth, p1Weight, p2Weight, p3Weight);
 
-    // Draw the pixels along the scanline from top to middle of the triangle.
-    // Change the start and end by the left and right slopes.
-    for (int i = p1.coord.y; i < int(p2.coord.y); i++)
-    {
-        if (i < screenResolution && i >= 0)
-        {
-            for (int j = scanStart; j < scanEnd; j++)
-            {
-                if (j < screenResolution && j >= 0)
-                {
-                    ////////////////////////////////////////////////////////////////////////////////////////////////// PERSPECTIVE CORRECTION
-                    // Move the points into a normalized space to make multiplying them for depth simpler.
+    float pixelVaryings[VaryingSlots(Shader::varyingCount)];
+    InterpolateVaryings<Shader::varyingCount>(varyings, p1Weight, p2Weight, p3Weight, pixelVaryings);
+
+    RGBColor vertexWeightedCol;
 
-                    Point a1;
-                    Point a2;
-                    Point a3;
+    if ((features & PIPE_FILL) && shader.Fragment(visible.tri, pixelVaryings, depth, vertexWeightedCol))
+        screenColorData[PixelIndex(i, j)] = vertexWeightedCol;
+}
 
-                    a1.coord.x = (p1.coord.x - float(j)) / p1.coord.z;
-                    a1.coord.y = (p1.coord.y - float(i)) / p1.coord.z;
-                    a2.coord.x = (p2.coord.x - float(j)) / p2.coord.z;
-                    a2.coord.y = (p2.coord.y - float(i)) / p2.coord.z;
-                    a3.coord.x = (p3.coord.x - float(j)) / p3.coord.z;
-                    a3.coord.y = (p3.coord.y - float(i)) / p3.coord.z;
 
+// Features a shader is compiled with for a pipeline feature mask.
+// Features that change nothing are removed, so identical variants are only compiled once.
+template <template <int> class ShaderType>
+constexpr int ShaderFeatures(int features)
+{
+    return CanonicalFeatures(features & (ShaderType<0>::usedFeatures | PIPE_FILL | PIPE_DEPTH_EQUAL));
+}
 
-                    // vertex weights must be more the further they are from the camera.
-                    // This means that they pull the colors and textures towards themselves.
-                    // This is done by making them closer to the center (0, 0).
-                    // These modified points are only used to find the interpolated texture coordinates, the screen space ones are used in deciding where to place the pixel.
 
-                    float denominator = ((a2.coord.y - a3.coord.y) * (a1.coord.x - a3.coord.x) + (a3.coord.x - a2.coord.x) * (a1.coord.y - a3.coord.y));
-                    if (denominator != 0)
-                        denominator = 1 / denominator;
+// Only coverage matters when writing depth or the visibility buffer
+template <template <int> class ShaderType>
+constexpr int ShaderCoverageFeatures(int features)
+{
+    return ShaderFeatures<ShaderType>(features) & (ShaderType<0>::coverageFeatures | PIPE_FILL);
+}
 
-                    float p1Weight = ((a2.coord.y - a3.coord.y) * -a3.coord.x + (a3.coord.x - a2.coord.x) * -a3.coord.y) * denominator;
-                    float p2Weight = ((a3.coord.y - a1.coord.y) * -a3.coord.x + (a1.coord.x - a3.coord.x) * -a3.coord.y) * denominator;
-                    float p3Weight = 1 - p1Weight - p2Weight;
 
+// Shade a run of pixels in a row of the visibility buffer that all use this shader
+template <class Shader, int features>
+void ShadeVisibleSpan(int i, int start, int end)
+{
+    Shader shader;
+    float varyings[3][VaryingSlots(Shader::varyingCount)];
+    uint32_t setupId = 0;
 
-                    
-                    //////////////////////////////////////////////////////////////////////////////////////////////////
+    for (int j = start; j < end; j++)
+    {
+        uint32_t id = visibilityBuffer[PixelIndex(i, j)];
 
-                    float depth = (p1.coord.z * p1Weight) + (p2.coord.z * p2Weight) + (p3.coord.z * p3Weight);
+        if (id == 0 || SkipShading(i, j))
+            continue;
 
-                    
+        const VisibleTriangle& visible = visibleTriangles[id - 1];
 
-                    if (depth > depthBuffer[(i * screenResolution) + j])
-                    {
-                        float weightedU = ((p1.uv.u * p1Weight) + (p2.uv.u * p2Weight) + (p3.uv.u * p3Weight)) * 128;
-                        float weightedV = ((p1.uv.v * p1Weight) + (p2.uv.v * p2Weight) + (p3.uv.v * p3Weight)) * 128;
-
-                        float colWeightR = (p1.light.r * p1Weight) + (p2.light.r * p2Weight) + (p3.light.r * p3Weight);
-                        float colWeightG = (p1.light.g * p1Weight) + (p2.light.g * p2Weight) + (p3.light.g * p3Weight);
-                        float colWeightB = (p1.light.b * p1Weight) + (p2.light.b * p2Weight) + (p3.light.b * p3Weight);
-
-
-                        RGBColor vertexWeightedCol;
-
-                        bool dontDraw = true;
-                        
-                        if (fillTris)
-                        {
-                            dontDraw = false;
-                            if (shadeFlat)
-                            {
-                                vertexWeightedCol = { 255, 255, 255 };
-                            }
-                            else
-                            {
-                                if (weightedU > 127)
-                                    weightedU = 127;
-                                if (weightedU < 0)
-                                    weightedU = 0;
-                                if (weightedV > 127)
-                                    weightedV = 127;
-                                if (weightedV < 0)
-                                    weightedV = 0;
-
-                                if (applyTextureFilter)
-                                {
-                                    vertexWeightedCol = Filter(weightedU, weightedV);
-
-                                    if (vertexWeightedCol.r == 255 && vertexWeightedCol.g == 0 && vertexWeightedCol.b == 255)
-                                        dontDraw = true;
-                                }
-                                else
-                                {
-                                    vertexWeightedCol = loadedTexture.px[int(weightedU) + (int(weightedV) * 128)];
-
-                                    if (vertexWeightedCol.r == 255 && vertexWeightedCol.g == 0 && vertexWeightedCol.b == 255)
-                                        dontDraw = true;
-                                }
-                            }
-                            if (vertexColorEnabled)
-                            {
-                                if (vertexWeightedCol.r - colWeightR > 0)
-                                    vertexWeightedCol.r -= colWeightR;
-                                else
-                                    vertexWeightedCol.r = 0;
-                                if (vertexWeightedCol.g - colWeightG > 0)
-                                    vertexWeightedCol.g -= colWeightG;
-                                else
-                                    vertexWeightedCol.g = 0;
-                                if (vertexWeightedCol.b - colWeightB > 0)
-                                    vertexWeightedCol.b -= colWeightB;
-                                else
-                                    vertexWeightedCol.b = 0;
-                            }
-                            if (faceLighting)
-                            {
-                                if (vertexWeightedCol.r - tri.lighting > 0)
-                                    vertexWeightedCol.r -= tri.lighting;
-                                else
-                                    vertexWeightedCol.r = 0;
-                                if (vertexWeightedCol.g - tri.lighting > 0)
-                                    vertexWeightedCol.g -= tri.lighting;
-                                else
-                                    vertexWeightedCol.g = 0;
-                                if (vertexWeightedCol.b - tri.lighting > 0)
-                                    vertexWeightedCol.b -= tri.lighting;
-                                else
-                                    vertexWeightedCol.b = 0;
-                            }
-                            if (fog)
-                            {
-                                if (1 / depth > 20)
-                                {
-                                    if (vertexWeightedCol.r - ((1 / depth) - 20) * fogDepth > 0)
-                                        vertexWeightedCol.r -= ((1 / depth) - 20) * fogDepth;
-                                    else
-                                        vertexWeightedCol.r = 0;
-                                    if (vertexWeightedCol.g - ((1 / depth) - 20) * fogDepth > 0)
-                                        vertexWeightedCol.g -= ((1 / depth) - 20) * fogDepth;
-                                    else
-                                        vertexWeightedCol.g = 0;
-                                    if (vertexWeightedCol.b - ((1 / depth) - 20) * fogDepth > 0)
-                                        vertexWeightedCol.b -= ((1 / depth) - 20) * fogDepth;
-                                    else
-                                        vertexWeightedCol.b = 0;
-                                }
-                            }
-                        }
-
-                        if (wireframe)
-                        {
-                            if (i - 4 < p1.coord.y || j - 2 < scanStart || j + 2 > scanEnd)
-                            {
-                                vertexWeightedCol = { 190, 190, 190 };
-                                dontDraw = false;
-                            }
-                        }
-
-                        if (!dontDraw)
-                        {
-                            screenColorData[(i * screenResolution) + j] = vertexWeightedCol;
-                            depthBuffer[(i * screenResolution) + j] = depth;
-                        }
-                    }
-                }
-                else if (j < 0)
-                    j = -1;
-                else if (j > screenResolution)
-                    j = scanEnd;
-            }
-            scanStart -= leftSlope;
-            scanEnd -= rightSlope;
-        }
-        else if (i < 0)
-        {
-            if (p2.coord.y < 0)
-            {
-                i = p2.coord.y;
-                scanStart -= leftSlope * -(int(p1.coord.y) - int(p2.coord.y));
-                scanEnd -= rightSlope * -(int(p1.coord.y) - int(p2.coord.y));
-            }
-            else
-            {
-                i = -1;
-                scanStart -= leftSlope * -int(p1.coord.y);
-                scanEnd -= rightSlope * -int(p1.coord.y);
-            }
-        }
-        else
+        // Neighbouring pixels mostly show the same triangle, so it's only bound and set up when that changes
+        if (id != setupId)
         {
-            return;
+            if (boundTexture.texture != visible.texture)
+                BindTexture(visible.texture);
+
+            for (int k = 0; k < 3; k++)
+                shader.Vertex(visible.tri, k, varyings[k]);
+
+            shader.Setup(visible.tri, visible.setup, &visible.gradients);
+            setupId = id;
         }
-        
+
+        ShadeVisiblePixel<Shader, features>(shader, varyings, visible, i, j);
     }
+}
 
-    if ((p3.coord.y - p1.coord.y) != 0)
-        leftSlope = (p1.coord.x - p3.coord.x) / (p3.coord.y - p1.coord.y);
-    else
-        leftSlope = 1000;
-    if ((p3.coord.y - p2.coord.y) != 0)
-        rightSlope = (p2.coord.x - p3.coord.x) / (p3.coord.y - p2.coord.y);
-    else
-        leftSlope = 1000;
-    
 
-    if (leftSlope > rightSlope)
-        swap(leftSlope, rightSlope);
+int PipelineFeatures()
+{
+    int features = 0;
 
-    if (int(p1.coord.y) == int(p2.coord.y))
+    if (fillTris)
     {
-        if (p1.coord.x > p2.coord.x)
-            scanStart = p2.coord.x;
-        else
-            scanEnd = p2.coord.x;
+        features |= PIPE_FILL;
+
+        if (shadeFlat)
+            features |= PIPE_FLAT;
+        else if (applyTextureFilter)
+            features |= PIPE_FILTER;
+        if (vertexColorEnabled)
+            features |= PIPE_VERTEX_COLOR;
+        if (faceLighting)
+            features |= PIPE_LIGHTING;
+        if (fog)
+            features |= PIPE_FOG;
     }
+    if (drawPass == PASS_COLOR)
+        features |= PIPE_DEPTH_EQUAL;
 
-    // Draw the pixels along the scanline from top to middle of the triangle.
-    // Change the start and end by the left and right slopes.
-    for (int i = p2.coord.y; i < int(p3.coord.y); i++)
-    {
-        if (i < screenResolution && i >= 0)
-        {
-            for (int j = scanStart; j < scanEnd; j++)
-            {
-                if (j < screenResolution && j >= 0)
-                {
-                    ////////////////////////////////////////////////////////////////////////////////////////////////// PERSPECTIVE CORRECTION
-                    // Move the points into a normalized space to make multiplying them for depth simpler.
-
-                    Point a1;
-                    Point a2;
-                    Point a3;
+    return features;
+}
 
-                    a1.coord.x = (p1.coord.x - float(j)) / p1.coord.z;
-                    a1.coord.y = (p1.coord.y - float(i)) / p1.coord.z;
-                    a2.coord.x = (p2.coord.x - float(j)) / p2.coord.z;
-                    a2.coord.y = (p2.coord.y - float(i)) / p2.coord.z;
-                    a3.coord.x = (p3.coord.x - float(j)) / p3.coord.z;
-                    a3.coord.y = (p3.coord.y - float(i)) / p3.coord.z;
 
+// The compiled kernels of one shader for one feature mask
+template <template <int> class ShaderType, int mask>
+MaterialPipeline MakeMaterialPipeline()
+{
+    const int features = ShaderFeatures<ShaderType>(mask);
+    const int coverage = ShaderCoverageFeatures<ShaderType>(mask);
+
+    MaterialPipeline pipeline;
+    pipeline.draw = &DrawTrianglePipeline<ShaderType<features>, features>;
+    pipeline.drawDepth = &DrawTriangleDepthPipeline<ShaderType<coverage>, coverage>;
+    pipeline.drawVisibility = &DrawTriangleVisibilityPipeline<ShaderType<coverage>, coverage>;
+    pipeline.drawMultisample = &DrawTriangleMultisamplePipeline<ShaderType<features & ~PIPE_DEPTH_EQUAL>, features & ~PIPE_DEPTH_EQUAL>;
+    pipeline.shadeVisibleSpan = &ShadeVisibleSpan<ShaderType<features & ~PIPE_DEPTH_EQUAL>, features & ~PIPE_DEPTH_EQUAL>;
+    return pipeline;
+}
 
-                    // vertex weights must be more the further they are from the camera.
-                    // This means that they pull the colors and textures towards themselves.
-                    // This is done by making them closer to the center (0, 0).
-                    // These modified points are only used to find the interpolated texture coordinates, the screen space ones are used in deciding where to place the pixel.
 
-                    float denominator = ((a2.coord.y - a3.coord.y) * (a1.coord.x - a3.coord.x) + (a3.coord.x - a2.coord.x) * (a1.coord.y - a3.coord.y));
-                    if (denominator != 0)
-                        denominator = 1 / denominator;
+// Tables of every compiled variant of the pipeline, indexed by the feature mask
+template <template <int> class ShaderType, size_t... masks>
+array<MaterialPipeline, PIPE_VARIANTS> MakeMaterialTable(index_sequence<masks...>)
+{
+    return { { MakeMaterialPipeline<ShaderType, int(masks)>()... } };
+}
 
-                    float p1Weight = ((a2.coord.y - a3.coord.y) * -a3.coord.x + (a3.coord.x - a2.coord.x) * -a3.coord.y) * denominator;
-                    float p2Weight = ((a3.coord.y - a1.coord.y) * -a3.coord.x + (a1.coord.x - a3.coord.x) * -a3.coord.y) * denominator;
-                    float p3Weight = 1 - p1Weight - p2Weight;
 
+const array<MaterialPipeline, PIPE_VARIANTS> materialTables[MATERIAL_COUNT] =
+{
+    MakeMaterialTable<LitShader>(make_index_sequence<PIPE_VARIANTS>()),
+    MakeMaterialTable<UnlitShader>(make_index_sequence<PIPE_VARIANTS>()),
+    MakeMaterialTable<VertexColorShader>(make_index_sequence<PIPE_VARIANTS>()),
+    MakeMaterialTable<DebugDepthShader>(make_index_sequence<PIPE_VARIANTS>()),
+    MakeMaterialTable<DebugUVShader>(make_index_sequence<PIPE_VARIANTS>())
+};
 
 
-                    //////////////////////////////////////////////////////////////////////////////////////////////////
+void SelectPipeline()
+{
+    int features = PipelineFeatures();
 
-                    float depth = (p1.coord.z * p1Weight) + (p2.coord.z * p2Weight) + (p3.coord.z * p3Weight);
+    for (int m = 0; m < MATERIAL_COUNT; m++)
+        materialPipelines[m] = materialTables[m][features];
+}
 
 
-                    if (depth > depthBuffer[(i * screenResolution) + j])
-                    {
-                        float colWeightR = (p1.light.r * p1Weight) + (p2.light.r * p2Weight) + (p3.light.r * p3Weight);
-                        float colWeightG = (p1.light.g * p1Weight) + (p2.light.g * p2Weight) + (p3.light.g * p3Weight);
-                        float colWeightB = (p1.light.b * p1Weight) + (p2.light.b * p2Weight) + (p3.light.b * p3Weight);
-
-                        float weightedU = ((p1.uv.u * p1Weight) + (p2.uv.u * p2Weight) + (p3.uv.u * p3Weight)) * 128;
-                        float weightedV = ((p1.uv.v * p1Weight) + (p2.uv.v * p2Weight) + (p3.uv.v * p3Weight)) * 128;
-
-                        if (weightedU > 127)
-                            weightedU = 127;
-                        if (weightedU < 0)
-                            weightedU = 0;
-                        if (weightedV > 127)
-                            weightedV = 127;
-                        if (weightedV < 0)
-                            weightedV = 0;
-
-                        RGBColor vertexWeightedCol;
-
-                        bool dontDraw = true;
-
-                        if (fillTris)
-                        {
-                            dontDraw = false;
-                            if (shadeFlat)
-                            {
-                                vertexWeightedCol = { 255, 255, 255 };
-                            }
-                            else
-                            {
-                                if (weightedU > 127)
-                                    weightedU = 127;
-                                if (weightedU < 0)
-                                    weightedU = 0;
-                                if (weightedV > 127)
-                                    weightedV = 127;
-                                if (weightedV < 0)
-                                    weightedV = 0;
-
-                                if (applyTextureFilter)
-                                {
-                                    vertexWeightedCol = Filter(weightedU, weightedV);
-
-                                    if (vertexWeightedCol.r == 255 && vertexWeightedCol.g == 0 && vertexWeightedCol.b == 255)
-                                        dontDraw = true;
-                                }
-                                else
-                                {
-                                    vertexWeightedCol = loadedTexture.px[int(weightedU) + (int(weightedV) * 128)];
-
-                                    if (vertexWeightedCol.r == 255 && vertexWeightedCol.g == 0 && vertexWeightedCol.b == 255)
-                                        dontDraw = true;
-                                }
-                            }
-                            if (vertexColorEnabled)
-                            {
-                                if (vertexWeightedCol.r - colWeightR > 0)
-                                    vertexWeightedCol.r -= colWeightR;
-                                else
-                                    vertexWeightedCol.r = 0;
-                                if (vertexWeightedCol.g - colWeightG > 0)
-                                    vertexWeightedCol.g -= colWeightG;
-                                else
-                                    vertexWeightedCol.g = 0;
-                                if (vertexWeightedCol.b - colWeightB > 0)
-                                    vertexWeightedCol.b -= colWeightB;
-                                else
-                                    vertexWeightedCol.b = 0;
-                            }
-                            if (faceLighting)
-                            {
-                                if (vertexWeightedCol.r - tri.lighting > 0)
-                                    vertexWeightedCol.r -= tri.lighting;
-                                else
-                                    vertexWeightedCol.r = 0;
-                                if (vertexWeightedCol.g - tri.lighting > 0)
-                                    vertexWeightedCol.g -= tri.lighting;
-                                else
-                                    vertexWeightedCol.g = 0;
-                                if (vertexWeightedCol.b - tri.lighting > 0)
-                                    vertexWeightedCol.b -= tri.lighting;
-                                else
-                                    vertexWeightedCol.b = 0;
-                            }
-                            if (fog)
-                            {
-                                if (1 / depth > 20)
-                                {
-                                    if (vertexWeightedCol.r - ((1 / depth) - 20) * fogDepth > 0)
-                                        vertexWeightedCol.r -= ((1 / depth) - 20) * fogDepth;
-                                    else
-                                        vertexWeightedCol.r = 0;
-                                    if (vertexWeightedCol.g - ((1 / depth) - 20) * fogDepth > 0)
-                                        vertexWeightedCol.g -= ((1 / depth) - 20) * fogDepth;
-                                    else
-                                        vertexWeightedCol.g = 0;
-                                    if (vertexWeightedCol.b - ((1 / depth) - 20) * fogDepth > 0)
-                                        vertexWeightedCol.b -= ((1 / depth) - 20) * fogDepth;
-                                    else
-                                        vertexWeightedCol.b = 0;
-                                }
-                            }
-                        }
-
-                        if (wireframe)
-                        {
-                            if (i - 4 < p1.coord.y || j - 2 < scanStart || j + 2 > scanEnd)
-                            {
-                                vertexWeightedCol = { 190, 190, 190 };
-                                dontDraw = false;
-                            }
-                        }
-
-                        if (!dontDraw)
-                        {
-                            screenColorData[(i * screenResolution) + j] = vertexWeightedCol;
-                            depthBuffer[(i * screenResolution) + j] = depth;
-                        }
-                    }
-                }
-                else if (j < 0)
-                    j = -1;
-                else if (j > screenResolution)
-                    j = scanEnd;
-            }
+void ShadeVisibilityBuffer()
+{
+    for (int i = 0; i < screenHeight; i++)
+    {
+        int start = 0;
+        int material = -1;
 
-            scanStart -= leftSlope;
-            scanEnd -= rightSlope;
-        }
-        else if (i < 0)
+        // Neighbouring pixels almost always share a material, so each run of them is shaded with one call
+        for (int j = 0; j < screenWidth; j++)
         {
-            if (p3.coord.y < 0)
-                return;
-            else
+            uint32_t id = visibilityBuffer[PixelIndex(i, j)];
+
+            if (id == 0)
+                continue;
+
+            int pixelMaterial = visibleTriangles[id - 1].material;
+
+            if (pixelMaterial != material)
             {
-                i = -1;
-                scanStart -= leftSlope * -p2.coord.y;
-                scanEnd -= rightSlope * -p2.coord.y;
+                if (material >= 0)
+                    materialPipelines[material].shadeVisibleSpan(i, start, j);
+
+                material = pixelMaterial;
+                start = j;
             }
         }
-        else
-        {
-            return;
-        }
+
+        if (material >= 0)
+            materialPipelines[material].shadeVisibleSpan(i, start, screenWidth);
     }
 }
 
 
+
 void processInput(GLFWwindow* window)
 {
     cameraVelocity.x = (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) - (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS);
     cameraVelocity.y = (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS) - (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS);
     cameraVelocity.z = (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) - (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS);
     
-    fov += 0.01 * ((glfwGetKey(window, GLFW_KEY_KP_4) == GLFW_PRESS) - (glfwGetKey(window, GLFW_KEY_KP_6) == GLFW_PRESS));
+    int zoom = (glfwGetKey(window, GLFW_KEY_KP_4) == GLFW_PRESS) - (glfwGetKey(window, GLFW_KEY_KP_6) == GLFW_PRESS);
+    fov += 0.01 * zoom;
+
+    if (zoom != 0)
+        InvalidateFrame();
 
     cameraRotVelocity = 0.01 * ((glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS) - (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS));
 
     cameraRotXVelocity = 0.01 * ((glfwGetKey(window, GLFW_KEY_KP_8) == GLFW_PRESS) - (glfwGetKey(window, GLFW_KEY_KP_2) == GLFW_PRESS));
 
+    // Keep drawing while the camera is moving, or the loop would wait for events before the physics sees it
+    if (cameraVelocity.x != 0 || cameraVelocity.y != 0 || cameraVelocity.z != 0 || cameraRotVelocity != 0 || cameraRotXVelocity != 0)
+        InvalidateFrame();
+
     glfwSetKeyCallback(window, key_callback);
 }
 
@@ -1277,7 +4836,8 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     {
         if (key == GLFW_KEY_ESCAPE)
         {
-           glfwTerminate();
+            // The main loop stops, then waits for the streaming threads before GLFW is shut down
+            glfwSetWindowShouldClose(window, GLFW_TRUE);
         }
 
         if (key == GLFW_KEY_SPACE)
@@ -1334,6 +4894,99 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
         {
             dofBlur = !dofBlur;
         }
+
+        if (key == GLFW_KEY_V)
+        {
+            visibilityBufferMode = !visibilityBufferMode;
+        }
+
+        if (key == GLFW_KEY_Z)
+        {
+            depthPrePass = !depthPrePass;
+        }
+
+        if (key == GLFW_KEY_O)
+        {
+            sortFrontToBack = !sortFrontToBack;
+        }
+
+        if (key == GLFW_KEY_H)
+        {
+            hierarchicalZ = !hierarchicalZ;
+        }
+
+        if (key == GLFW_KEY_F)
+        {
+            depthFormat = (depthFormat + 1) % DEPTH_FORMAT_COUNT;
+        }
+
+        if (key == GLFW_KEY_G)
+        {
+            depthPrecisionView = !depthPrecisionView;
+        }
+
+        if (key == GLFW_KEY_Q)
+        {
+            msaa = !msaa;
+        }
+
+        if (key == GLFW_KEY_R)
+        {
+            dynamicResolution = !dynamicResolution;
+        }
+
+        if (key == GLFW_KEY_C)
+        {
+            checkerboard = !checkerboard;
+        }
+
+        if (key == GLFW_KEY_L)
+        {
+            frameCap = !frameCap;
+        }
+
+        if (key == GLFW_KEY_E)
+        {
+            // Off, then each mode in turn. The textures keep the modes their materials gave them.
+            wrapOverride = (wrapOverride + 1) % (WRAP_MODE_COUNT + 1);
+
+            // Rebind, so the next triangle picks up the new mode
+            boundTexture.texture = nullptr;
+        }
+
+        if (key == GLFW_KEY_N)
+        {
+            mipMode = (mipMode + 1) % MIP_MODE_COUNT;
+        }
+
+        if (key == GLFW_KEY_K)
+        {
+            fastClear = !fastClear;
+        }
+
+        if (key == GLFW_KEY_B)
+        {
+            // The time printed is for the format being switched away from, so pressing it twice compares both
+            PrintTextureStats();
+            compressedTextures = !compressedTextures;
+        }
+
+        if (key == GLFW_KEY_T)
+        {
+            // Last frame's history is stored in the old layout
+            tiledFramebuffer = !tiledFramebuffer;
+            historyValid = false;
+        }
+
+        if (key == GLFW_KEY_M)
+        {
+            // Cycle through the materials
+            for (int i = 0; i < loadedMeshInstances.size(); i++)
+                loadedMeshInstances[i].material = (loadedMeshInstances[i].material + 1) % MATERIAL_COUNT;
+        }
+
+        // Any key may have changed a setting that changes the picture
+        InvalidateFrame();
     }
 }
 
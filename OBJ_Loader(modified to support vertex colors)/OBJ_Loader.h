@@ -640,6 +640,11 @@ namespace objl
 							pathtomat += temp[i] + "/";
 						}
 					}
+
+					pathtomat += algorithm::tail(curline);
+
+					// Load Materials
+					LoadMaterials(pathtomat);
 				}
 			}
 
@@ -693,6 +698,99 @@ namespace objl
 		// Loaded Material Objects
 		std::vector<Material> LoadedMaterials;
 
+		// Load Materials from .mtl file
+		//
+		// Texture map paths are kept as they are written in the file
+		bool LoadMaterials(std::string path)
+		{
+			// If the file is not a material file return false
+			if (path.size() < 4 || path.substr(path.size() - 4, path.size()) != ".mtl")
+				return false;
+
+			std::ifstream file(path);
+
+			// If the file is not found return false
+			if (!file.is_open())
+				return false;
+
+			Material tempMaterial;
+
+			bool listening = false;
+
+			// Go through each line looking for material variables
+			std::string curline;
+			while (std::getline(file, curline))
+			{
+				// Lines from files made on Windows keep their carriage return
+				if (!curline.empty() && curline.back() == '\r')
+					curline.pop_back();
+
+				std::string token = algorithm::firstToken(curline);
+				std::vector<std::string> values;
+
+				// new material and material name
+				if (token == "newmtl")
+				{
+					if (listening)
+						LoadedMaterials.push_back(tempMaterial);
+
+					tempMaterial = Material();
+					listening = true;
+
+					if (curline.size() > 7)
+						tempMaterial.name = algorithm::tail(curline);
+					else
+						tempMaterial.name = "none";
+				}
+				// Ambient, Diffuse and Specular Colors
+				else if (token == "Ka" || token == "Kd" || token == "Ks")
+				{
+					algorithm::split(algorithm::tail(curline), values, " ");
+
+					if (values.size() != 3)
+						continue;
+
+					Vec3& color = token == "Ka" ? tempMaterial.Ka : (token == "Kd" ? tempMaterial.Kd : tempMaterial.Ks);
+					color.X = std::stof(values[0]);
+					color.Y = std::stof(values[1]);
+					color.Z = std::stof(values[2]);
+				}
+				// Specular Exponent
+				else if (token == "Ns")
+					tempMaterial.Ns = std::stof(algorithm::tail(curline));
+				// Optical Density
+				else if (token == "Ni")
+					tempMaterial.Ni = std::stof(algorithm::tail(curline));
+				// Dissolve
+				else if (token == "d")
+					tempMaterial.d = std::stof(algorithm::tail(curline));
+				// Illumination
+				else if (token == "illum")
+					tempMaterial.illum = std::stoi(algorithm::tail(curline));
+				// Texture Maps
+				else if (token == "map_Ka")
+					tempMaterial.map_Ka = algorithm::tail(curline);
+				else if (token == "map_Kd")
+					tempMaterial.map_Kd = algorithm::tail(curline);
+				else if (token == "map_Ks")
+					tempMaterial.map_Ks = algorithm::tail(curline);
+				else if (token == "map_Ns")
+					tempMaterial.map_Ns = algorithm::tail(curline);
+				else if (token == "map_d")
+					tempMaterial.map_d = algorithm::tail(curline);
+				else if (token == "map_Bump" || token == "map_bump" || token == "bump")
+					tempMaterial.map_bump = algorithm::tail(curline);
+			}
+
+			// Deal with last material
+			if (listening)
+				LoadedMaterials.push_back(tempMaterial);
+
+			// Test to see if anything was loaded
+			// If not return false
+			return !LoadedMaterials.empty();
+		}
+
 	private:
 		// Generate vertices from a list of positions, 
 		//	tcoords, normals and a face line